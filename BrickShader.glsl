@@ -0,0 +1,157 @@
+#version 430 core
+
+// min/max pyramid over bricks of the volume, and the empty space culling that uses it
+// brickPass 0: min/max of every 8x8x8 brick of volumeTex into level 0 of the pyramid, in raw voxel units
+// brickPass 1: min/max of the 2x2x2 children on the level below into the next level
+// brickPass 2: list the extraction workgroups whose voxels can contain isoLevel in ActiveGroups
+// brickPass 3: turn the number of listed workgroups into the indirect dispatch commands in ActiveDispatch
+uniform int brickPass;
+
+uniform float isoPerRaw; // 65536 / 65535 / maxImgValue
+uniform float texelScale; // see ComputeShader.glsl
+uniform float texelOffset;
+uniform vec3 cubeRatio;
+uniform float isoLevel;
+uniform ivec3 groupShape; // extraction workgroups per axis
+uniform ivec3 groupCells; // cells of an extraction workgroup per axis (its local size in ComputeShader.glsl)
+uniform int brickLevels;
+uniform int pyramidLevel; // level of the volume pyramid the extraction samples (see ComputeShader.glsl)
+uniform uint groupsPerDispatch; // workgroups of one chunk of ActiveGroups, a multiple of 256
+uniform int dispatchCount; // chunks ActiveDispatch has room for
+
+uniform sampler3D volumeTex;
+layout(rg16ui, binding = 3) uniform writeonly uimage3D outBrick;
+layout(rg16ui, binding = 4) uniform readonly uimage3D inBrick;
+uniform usampler3D brickMinMax;
+
+// data[0]: number of active workgroups, then one packed workgroup each
+layout(std430, binding = 13) buffer ActiveGroups {
+	uint data[];
+} activeGroups;
+// one indirect dispatch command per chunk of groupsPerDispatch workgroups of ActiveGroups
+layout(std430, binding = 17) writeonly buffer ActiveDispatch {
+	uint data[];
+} activeDispatch;
+
+layout(local_size_x = 4, local_size_y = 4, local_size_z = 4) in;
+
+const int brickSize = 8;
+
+void buildLevel0(ivec3 brick) {
+	float minValue = 65535.0;
+	float maxValue = 0.0;
+	ivec3 volumeShape = textureSize(volumeTex, 0);
+	for (int z = 0; z < brickSize; z++) {
+		for (int y = 0; y < brickSize; y++) {
+			for (int x = 0; x < brickSize; x++) {
+				// texels outside the volume read as 0, the same as in the extraction kernel
+				ivec3 texel = brick * brickSize + ivec3(x, y, z);
+				float value = 0.0;
+				if (all(lessThan(texel, volumeShape))) {
+					value = texelFetch(volumeTex, texel, 0).r * texelScale + texelOffset;
+				}
+				minValue = min(minValue, value);
+				maxValue = max(maxValue, value);
+			}
+		}
+	}
+	// the values as the extraction kernel reads them, rounded outwards to raw units;
+	// exact for R16, whose texels are raw values
+	minValue = clamp(floor(minValue / isoPerRaw + 0.01), 0.0, 65535.0);
+	maxValue = clamp(ceil(maxValue / isoPerRaw - 0.01), 0.0, 65535.0);
+	imageStore(outBrick, brick, uvec4(uint(minValue), uint(maxValue), 0, 0));
+}
+
+void buildLevel(ivec3 brick) {
+	uint minValue = 65535;
+	uint maxValue = 0;
+	ivec3 childShape = imageSize(inBrick);
+	for (int i = 0; i < 8; i++) {
+		ivec3 child = brick * 2 + ivec3(i & 1, (i >> 1) & 1, i >> 2);
+		if (any(greaterThanEqual(child, childShape))) {
+			continue;
+		}
+		uvec2 childMinMax = imageLoad(inBrick, child).rg;
+		minValue = min(minValue, childMinMax.x);
+		maxValue = max(maxValue, childMinMax.y);
+	}
+	imageStore(outBrick, brick, uvec4(minValue, maxValue, 0, 0));
+}
+
+void cullGroup(ivec3 group) {
+	// voxels read by the group's lattice block: trilinear samples at (cells + 1) * cubeRatio on level pyramidLevel,
+	// widened by one voxel of that level on each side to stay conservative about rounding
+	ivec3 volumeShape = textureSize(volumeTex, 0);
+	ivec3 levelShape = max(volumeShape >> pyramidLevel, ivec3(1));
+	vec3 sampleLow = vec3(group * groupCells) * cubeRatio;
+	vec3 sampleHigh = vec3(group * groupCells + groupCells) * cubeRatio;
+	if (pyramidLevel > 0) {
+		float levelScale = 1.0 / float(1 << pyramidLevel);
+		sampleLow = max((sampleLow + 0.5) * levelScale - 0.5, vec3(0.0));
+		sampleHigh = max((sampleHigh + 0.5) * levelScale - 0.5, vec3(0.0));
+	}
+	ivec3 voxelLow = ivec3(sampleLow) - 1;
+	ivec3 voxelHigh = ivec3(sampleHigh) + 2;
+
+	uint minValue = 65535;
+	uint maxValue = 0;
+	// reading past the volume gives 0
+	if (any(lessThan(voxelLow, ivec3(0))) || any(greaterThanEqual(voxelHigh, levelShape))) {
+		minValue = 0;
+	}
+	voxelLow = clamp(voxelLow, ivec3(0), levelShape - 1);
+	voxelHigh = clamp(voxelHigh, ivec3(0), levelShape - 1);
+	// a voxel of the level averages 2^pyramidLevel voxels per side of the volume
+	voxelLow = voxelLow << pyramidLevel;
+	voxelHigh = min(((voxelHigh + 1) << pyramidLevel) - 1, textureSize(volumeTex, 0) - 1);
+
+	// the finest level on which the voxel box covers at most 4 bricks per side
+	int level = 0;
+	while (level < brickLevels - 1 && any(greaterThan((voxelHigh >> (level + 3)) - (voxelLow >> (level + 3)), ivec3(3)))) {
+		level++;
+	}
+	ivec3 brickLow = voxelLow >> (level + 3);
+	ivec3 brickHigh = min(voxelHigh >> (level + 3), textureSize(brickMinMax, level) - 1);
+	for (int z = brickLow.z; z <= brickHigh.z; z++) {
+		for (int y = brickLow.y; y <= brickHigh.y; y++) {
+			for (int x = brickLow.x; x <= brickHigh.x; x++) {
+				uvec2 brickMinMaxValue = texelFetch(brickMinMax, ivec3(x, y, z), level).rg;
+				minValue = min(minValue, brickMinMaxValue.x);
+				maxValue = max(maxValue, brickMinMaxValue.y);
+			}
+		}
+	}
+
+	// same normalization as getInputImgData; a cell is cut only if some corner is below isoLevel and some is not
+	float margin = 1e-4;
+	if (float(minValue) * isoPerRaw < isoLevel + margin && float(maxValue) * isoPerRaw >= isoLevel - margin) {
+		uint activeIndex = atomicAdd(activeGroups.data[0], 1);
+		activeGroups.data[1 + activeIndex] = uint(group.x) | (uint(group.y) << 10) | (uint(group.z) << 20);
+	}
+}
+
+void main() {
+	ivec3 id = ivec3(gl_GlobalInvocationID);
+
+	if (brickPass == 0) {
+		if (all(lessThan(id, imageSize(outBrick)))) buildLevel0(id);
+	}
+	else if (brickPass == 1) {
+		if (all(lessThan(id, imageSize(outBrick)))) buildLevel(id);
+	}
+	else if (brickPass == 2) {
+		if (all(lessThan(id, groupShape))) cullGroup(id);
+	}
+	else if (brickPass == 3 && id == ivec3(0)) {
+		// rows of 256 workgroups, so that only the last chunk runs past its end (see uploadActiveGroups);
+		// the extraction kernel maps (x, y) back to an index into the list and ignores the ones past the end
+		uint activeCount = activeGroups.data[0];
+		for (int chunk = 0; chunk < dispatchCount; chunk++) {
+			uint chunkCount = min(activeCount - min(activeCount, uint(chunk) * groupsPerDispatch), groupsPerDispatch);
+			uint rowLength = min(chunkCount, 256u);
+			activeDispatch.data[3 * chunk] = rowLength;
+			activeDispatch.data[3 * chunk + 1] = rowLength == 0 ? 1 : (chunkCount + rowLength - 1) / rowLength;
+			activeDispatch.data[3 * chunk + 2] = 1;
+		}
+	}
+}
@@ -1,13 +1,76 @@
 #version 430 core
 
+// compile time constants; the Shader that builds this kernel can #define them ahead of these defaults
+// (see compileExtractionShader): cells per workgroup and axis, and the side of a brick of the brick cache
+#ifndef GROUP_SIZE_X
+#define GROUP_SIZE_X 4
+#endif
+#ifndef GROUP_SIZE_Y
+#define GROUP_SIZE_Y 4
+#endif
+#ifndef GROUP_SIZE_Z
+#define GROUP_SIZE_Z 4
+#endif
+#ifndef CACHE_BRICK_SIDE
+#define CACHE_BRICK_SIDE 32
+#endif
+
 // uniforms
-uniform ivec3 inImgShape; // x, y, z of original scanned Img
-uniform float cubeRatio;     // size of a cube / size of an img pixel
+uniform ivec3 inImgShape; // texture shape of level pyramidLevel, reads past it are out of range
+uniform vec3 cubeRatio;     // size of a cube / size of an img pixel, per axis (see extraction_grid.h)
+uniform int pyramidLevel; // level of the volume pyramid read from volumeTex
 uniform float sizeCompressRatio;     // how much do I want the cube to be resized
+uniform vec3 gradientScale; // voxel gradients to physical ones, for voxels that are not cubes
 uniform float isoLevel; // the threshold
-uniform int maxImgValue;
+// a texel of volumeTex (R16, R8 or R16F, see VolumeQuantizer) is texel * texelScale + texelOffset in isoLevel units
+uniform float texelScale;
+uniform float texelOffset;
+// 0: one pass, triangles appended through an atomic counter (output buffers sized for the worst case)
+// 1: count pass, writes the number of triangles of every cell to CellTriangles
+// 2: write pass, CellTriangles holds exclusive prefix sums of the counts, i.e. where each cell writes
+// indexed mesh (run per lattice point, a lattice point owns the edges leaving it in +x, +y and +z):
+// 3: count the owned edges the surface crosses into LatticeVertices
+// 4: LatticeVertices holds prefix sums; write one vertex per crossed edge and pack the edge mask into the top bits
+// 5: run per cell after pass 1 and the scan; write 3 indices per triangle into OutIndices
+uniform int passMode;
+// pass 0 only; 1: a workgroup sums its triangles in shared memory and takes room for all of them with one atomicAdd
+// on OutTrianglesCount, 0: one atomicAdd per triangle
+uniform int useGroupAllocation;
+uniform ivec3 latticeShape; // cells per axis + 1
+// 1: dispatched indirectly over the workgroups BrickShader.glsl listed in ActiveGroups (empty space skipping),
+// one dispatch per chunk of the list, this one starting at entry activeGroupOffset
+uniform int useActiveGroups;
+uniform uint activeGroupOffset;
+// otherwise the grid goes out in slabs of workgroups, this one starting at groupOffset
+uniform ivec3 groupOffset;
+// what the output buffers hold; past that the mesh is cut short instead of written out of bounds
+uniform uint maxTriangles;
+uniform uint maxVertices;
+// 0: central differences of the volume around the vertex, 1: one fetch from the gradient texture (GradientShader.glsl)
+uniform int normalMode;
+
+uniform sampler3D volumeTex;
+uniform sampler3D gradientTex;
 
-layout(r16, binding = 1) uniform readonly image3D inImg;
+// 1: volumeTex only holds the layers of level pyramidLevel from volumeSlabOrigin on, as its level 0
+// (out of core slab batching, see createMarchingCubesInSlabs)
+uniform int useVolumeSlab;
+uniform ivec3 volumeSlabOrigin;
+// first layer of cells in CellTriangles, which then only holds the cells of one slab
+uniform int cellLayerOffset;
+
+// 1: read the volume through the page table of level pyramidLevel from the brick cache texture (see brick_cache.h)
+// instead of volumeTex, for volumes that are not resident as a whole
+uniform int useBrickCache;
+uniform sampler3D brickCacheTex;
+uniform ivec3 levelTexShape; // texture shape of level pyramidLevel
+uniform ivec3 brickGridShape; // bricks per side of the level
+uniform ivec3 cacheSlotsShape; // brick slots per side of brickCacheTex
+const int cacheBrickSide = CACHE_BRICK_SIDE;
+// slot + 1 of every brick of the level, 0 if it is not resident
+layout(std430, binding = 16) readonly buffer PageTable {
+	uint data[];
+} pageTable;
 
 layout(std430, binding = 2) writeonly buffer OutPositions {
 	vec4 data[];
@@ -15,9 +78,12 @@ layout(std430, binding = 2) writeonly buffer OutPositions {
 layout(std430, binding = 3) writeonly buffer OutNormals {
 	vec4 data[];
 } outNormals;
-layout(std430, binding = 4) writeonly buffer OutTrianglesCount {
+layout(std430, binding = 4) buffer OutTrianglesCount {
 	int data[];
 } outTrianglesCount;
+layout(std430, binding = 5) buffer CellTriangles {
+	uint data[];
+} cellTriangles;
 
 layout(std430, binding = 6) readonly buffer EdgeTable {
 	int data[];
@@ -26,12 +92,25 @@ layout(std430, binding = 7) readonly buffer TriTable {
 	int data[];
 } triTable;
 
-layout(local_size_x = 4, local_size_y = 4, local_size_z = 4) in;
+layout(std430, binding = 10) buffer LatticeVertices {
+	uint data[];
+} latticeVertices;
+layout(std430, binding = 12) writeonly buffer OutIndices {
+	uint data[];
+} outIndices;
+// data[0]: number of active workgroups, then one packed workgroup each
+layout(std430, binding = 13) readonly buffer ActiveGroups {
+	uint data[];
+} activeGroups;
+
+layout(local_size_x = GROUP_SIZE_X, local_size_y = GROUP_SIZE_Y, local_size_z = GROUP_SIZE_Z) in;
 
-float gridValue[8];
-vec3 gridCoord[8];
-// is it correct??
-int edgeToGridDict[12][2] = {
+// const, so they live in constant memory instead of being copied into every invocation
+const ivec3 cornerOffset[8] = {
+	ivec3(0, 0, 0), ivec3(1, 0, 0), ivec3(1, 1, 0), ivec3(0, 1, 0),
+	ivec3(0, 0, 1), ivec3(1, 0, 1), ivec3(1, 1, 1), ivec3(0, 1, 1)
+};
+const int edgeToGridDict[12][2] = {
 	{0, 1},
 	{1, 2},
 	{2, 3},
@@ -46,17 +125,57 @@ int edgeToGridDict[12][2] = {
 	{3, 7}
 };
 
+// which lattice point (relative to corner 0) owns each edge, and along which axis
+const ivec3 edgeOwnerOffset[12] = {
+	ivec3(0, 0, 0), ivec3(1, 0, 0), ivec3(0, 1, 0), ivec3(0, 0, 0),
+	ivec3(0, 0, 1), ivec3(1, 0, 1), ivec3(0, 1, 1), ivec3(0, 0, 1),
+	ivec3(0, 0, 0), ivec3(1, 0, 0), ivec3(1, 1, 0), ivec3(0, 1, 0)
+};
+const int edgeAxis[12] = { 0, 1, 0, 1, 0, 1, 0, 1, 2, 2, 2, 2 };
+// vertex offsets are stored in the low bits, the owned edge mask in the top 3
+const uint latticeOffsetMask = 0x1FFFFFFFu;
+
 bool isOutOfRange = false;
 
+// first cell (or lattice point) of this workgroup
+ivec3 workgroupOrigin;
+
+// texel of level pyramidLevel, 0 past the texture itself
+float getVolumeTexel(ivec3 texel) {
+	if (useBrickCache == 0) {
+		int lod = pyramidLevel;
+		if (useVolumeSlab == 1) {
+			// the slab has a halo around everything its workgroups read
+			texel -= volumeSlabOrigin;
+			lod = 0;
+		}
+		if (any(lessThan(texel, ivec3(0))) || any(greaterThanEqual(texel, textureSize(volumeTex, lod)))) {
+			return 0.0;
+		}
+		return texelFetch(volumeTex, texel, lod).r;
+	}
+
+	if (any(greaterThanEqual(texel, levelTexShape))) {
+		return 0.0;
+	}
+	ivec3 brick = texel / cacheBrickSide;
+	uint entry = pageTable.data[brick.x + brickGridShape.x * (brick.y + brickGridShape.y * brick.z)];
+	// only workgroups whose bricks are all resident get dispatched
+	if (entry == 0u) {
+		return 0.0;
+	}
+	int slot = int(entry) - 1;
+	ivec3 slotOrigin = ivec3(slot % cacheSlotsShape.x, (slot / cacheSlotsShape.x) % cacheSlotsShape.y, slot / (cacheSlotsShape.x * cacheSlotsShape.y)) * cacheBrickSide;
+	return texelFetch(brickCacheTex, slotOrigin + texel - brick * cacheBrickSide, 0).r;
+}
+
 // get value of Img in case query is out of range
 float getInputImgData(int x, int y, int z) {
 	if(x >= inImgShape.x || y >= inImgShape.y || z >= inImgShape.z || x < 0 || y < 0 || z < 0) {
 		isOutOfRange = true;
 		return 0.0;
 	}
-	else {
-		return imageLoad(inImg, ivec3(x, y, z)).r * 65536.0 / float(maxImgValue);
-	}
+	return getVolumeTexel(ivec3(x, y, z)) * texelScale + texelOffset;
 }
 
 // interpolations
@@ -79,6 +198,11 @@ float interpolate3D(float v1, float v2, float v3, float v4, float v5, float v6,
 
 float getInterpImgData(vec3 query) {
 	query = query * cubeRatio;
+	if (pyramidLevel > 0) {
+		// voxel centers of a coarser level lie between those of the level below
+		float levelScale = 1.0 / float(1 << pyramidLevel);
+		query = max((query + 0.5) * levelScale - 0.5, vec3(0.0));
+	}
 	ivec3 queryInt = ivec3(query);
 
 	int imgIntX = queryInt.x;
@@ -101,77 +225,235 @@ float getInterpImgData(vec3 query) {
 	return interpolate3D(v1, v2, v3, v4, v5, v6, v7, v8, x, y, z);
 }
 
-vec3 interpCubePositions(int index1, int index2) {
-	float v1Weight = abs(gridValue[index2] - isoLevel) /  abs(gridValue[index2] - gridValue[index1]);
+vec3 interpCubePositions(vec3 coord1, float value1, vec3 coord2, float value2) {
+	float v1Weight = abs(value2 - isoLevel) /  abs(value2 - value1);
 	// v1Weight = 0.5;
-	return gridCoord[index1] * v1Weight + gridCoord[index2] * (1 - v1Weight);
+	return coord1 * v1Weight + coord2 * (1 - v1Weight);
+}
+
+// grid values of the workgroup's lattice block (one more point than cells per side), sampled once
+// and shared by every invocation instead of each cell sampling its own 8 corners
+const uvec3 tileShape = gl_WorkGroupSize + uvec3(1);
+const uint tileVolume = tileShape.x * tileShape.y * tileShape.z;
+shared float tileValue[tileVolume];
+shared bool tileOutOfRange[tileVolume];
+
+// every invocation has to call this, before any early return
+void loadTile() {
+	ivec3 tileOrigin = workgroupOrigin;
+	uint workgroupVolume = gl_WorkGroupSize.x * gl_WorkGroupSize.y * gl_WorkGroupSize.z;
+	for (uint i = gl_LocalInvocationIndex; i < tileVolume; i += workgroupVolume) {
+		ivec3 tilePoint = ivec3(i % tileShape.x, (i / tileShape.x) % tileShape.y, i / (tileShape.x * tileShape.y));
+		isOutOfRange = false;
+		tileValue[i] = getInterpImgData(vec3(tileOrigin + tilePoint));
+		tileOutOfRange[i] = isOutOfRange;
+	}
+	isOutOfRange = false;
+	barrier();
+}
+
+// triangles of the workgroup (pass 0 with useGroupAllocation), and where in the output they start
+shared uint groupTriangleCount;
+shared uint groupFirstTriangle;
+
+// where the triangleCount triangles of this invocation go; every invocation has to call this, the same as loadTile,
+// after groupTriangleCount was set to 0 ahead of a barrier
+uint allocateGroupTriangles(uint triangleCount) {
+	uint firstTriangle = atomicAdd(groupTriangleCount, triangleCount);
+	barrier();
+	if (gl_LocalInvocationIndex == 0 && groupTriangleCount > 0) {
+		groupFirstTriangle = uint(atomicAdd(outTrianglesCount.data[0], int(groupTriangleCount)));
+	}
+	barrier();
+	return groupFirstTriangle + firstTriangle;
+}
+
+// grid value at a lattice point of this workgroup's tile, given relative to the tile origin
+float getTileValue(ivec3 tilePoint) {
+	uint i = tilePoint.x + tileShape.x * (tilePoint.y + tileShape.y * tilePoint.z);
+	isOutOfRange = isOutOfRange || tileOutOfRange[i];
+	return tileValue[i];
 }
 
 vec3 getNormal(vec3 position) {
-	float delta = 2.1;
-	delta /= cubeRatio;
-	float vx1 = getInterpImgData(vec3(position.x - delta, position.y, position.z));
-	float vx2 = getInterpImgData(vec3(position.x + delta, position.y, position.z));
-	float vy1 = getInterpImgData(vec3(position.x, position.y - delta, position.z));
-	float vy2 = getInterpImgData(vec3(position.x, position.y + delta, position.z));
-	float vz1 = getInterpImgData(vec3(position.x, position.y, position.z - delta));
-	float vz2 = getInterpImgData(vec3(position.x, position.y, position.z + delta));
-	return normalize(vec3(vx1 - vx2, vy1 - vy2, vz1-vz2));
+	if (normalMode == 1) {
+		// +0.5: texel centers, the same filtering getInterpImgData does by hand
+		vec3 texel = position * cubeRatio + 0.5;
+		return normalize(texture(gradientTex, texel / vec3(textureSize(gradientTex, 0))).xyz * gradientScale);
+	}
+
+	vec3 delta = 2.1 / cubeRatio;
+	float vx1 = getInterpImgData(vec3(position.x - delta.x, position.y, position.z));
+	float vx2 = getInterpImgData(vec3(position.x + delta.x, position.y, position.z));
+	float vy1 = getInterpImgData(vec3(position.x, position.y - delta.y, position.z));
+	float vy2 = getInterpImgData(vec3(position.x, position.y + delta.y, position.z));
+	float vz1 = getInterpImgData(vec3(position.x, position.y, position.z - delta.z));
+	float vz2 = getInterpImgData(vec3(position.x, position.y, position.z + delta.z));
+	return normalize(vec3(vx1 - vx2, vy1 - vy2, vz1-vz2) * gradientScale);
+}
+
+// passes 3 and 4
+void latticeMain() {
+	loadTile();
+
+	ivec3 point = workgroupOrigin + ivec3(gl_LocalInvocationID);
+	ivec3 tilePoint = ivec3(gl_LocalInvocationID);
+	if (any(greaterThanEqual(point, latticeShape))) {
+		return;
+	}
+	uint pointIndex = point.x + latticeShape.x * (point.y + latticeShape.y * point.z);
+
+	float pointValue = getTileValue(tilePoint);
+	uint edgeMask = 0;
+	for (int axis = 0; axis < 3; axis++) {
+		if (point[axis] + 1 >= latticeShape[axis]) {
+			continue;
+		}
+		ivec3 axisStep = ivec3(0);
+		axisStep[axis] = 1;
+		if ((pointValue < isoLevel) != (getTileValue(tilePoint + axisStep) < isoLevel)) {
+			edgeMask |= 1u << axis;
+		}
+	}
+
+	if (passMode == 3) {
+		latticeVertices.data[pointIndex] = uint(bitCount(edgeMask));
+		return;
+	}
+
+	// an offset past the mask is kept as the mask, past maxVertices, so that pass 5 drops its triangles
+	uint vertexIndex = latticeVertices.data[pointIndex];
+	latticeVertices.data[pointIndex] = min(vertexIndex, latticeOffsetMask) | (edgeMask << 29);
+	for (int axis = 0; axis < 3 && vertexIndex < maxVertices; axis++) {
+		if ((edgeMask & (1u << axis)) == 0) {
+			continue;
+		}
+		ivec3 axisStep = ivec3(0);
+		axisStep[axis] = 1;
+		vec3 position = interpCubePositions(vec3(point), pointValue, vec3(point + axisStep), getTileValue(tilePoint + axisStep));
+		outPositions.data[vertexIndex] = vec4(position, 1.0) * sizeCompressRatio;
+		outNormals.data[vertexIndex] = vec4(getNormal(position), 1.0);
+		vertexIndex++;
+	}
 }
 
 void main() {
-	gridCoord[0] = vec3(gl_GlobalInvocationID.x,   gl_GlobalInvocationID.y,   gl_GlobalInvocationID.z  );
-	gridCoord[1] = vec3(gl_GlobalInvocationID.x+1, gl_GlobalInvocationID.y,   gl_GlobalInvocationID.z  );
-	gridCoord[2] = vec3(gl_GlobalInvocationID.x+1,   gl_GlobalInvocationID.y+1, gl_GlobalInvocationID.z  );
-	gridCoord[3] = vec3(gl_GlobalInvocationID.x, gl_GlobalInvocationID.y+1, gl_GlobalInvocationID.z  );
-	gridCoord[4] = vec3(gl_GlobalInvocationID.x,   gl_GlobalInvocationID.y,   gl_GlobalInvocationID.z+1);
-	gridCoord[5] = vec3(gl_GlobalInvocationID.x+1, gl_GlobalInvocationID.y,   gl_GlobalInvocationID.z+1);
-	gridCoord[6] = vec3(gl_GlobalInvocationID.x+1,   gl_GlobalInvocationID.y+1, gl_GlobalInvocationID.z+1);
-	gridCoord[7] = vec3(gl_GlobalInvocationID.x, gl_GlobalInvocationID.y+1, gl_GlobalInvocationID.z+1);
+	uvec3 workgroup = gl_WorkGroupID + uvec3(groupOffset);
+	if (useActiveGroups == 1) {
+		uint activeIndex = activeGroupOffset + gl_WorkGroupID.x + gl_NumWorkGroups.x * gl_WorkGroupID.y;
+		// the last chunk is rounded up to whole rows
+		if (activeIndex >= activeGroups.data[0]) {
+			return;
+		}
+		uint packedGroup = activeGroups.data[1 + activeIndex];
+		workgroup = uvec3(packedGroup & 0x3FF, (packedGroup >> 10) & 0x3FF, packedGroup >> 20);
+	}
+	workgroupOrigin = ivec3(workgroup * gl_WorkGroupSize);
 
-	for(int i = 0; i < 8; i++) {
-		gridValue[i] = getInterpImgData(gridCoord[i]);
+	if (passMode == 3 || passMode == 4) {
+		latticeMain();
+		return;
 	}
 
-	if(isOutOfRange == true) {
+	// the active list covers the lattice, which can have one more workgroup per axis than the cells
+	ivec3 cellShape = latticeShape - 1;
+	if (any(greaterThanEqual(workgroupOrigin, cellShape))) {
 		return;
 	}
-	
+
+	bool isGroupAllocated = passMode == 0 && useGroupAllocation == 1;
+	if (isGroupAllocated && gl_LocalInvocationIndex == 0) {
+		groupTriangleCount = 0;
+	}
+	loadTile();
+
+	ivec3 cell = workgroupOrigin + ivec3(gl_LocalInvocationID);
+	ivec3 tileCell = ivec3(gl_LocalInvocationID);
+	// the last workgroup of an axis can reach past the cells (its tile still covers them)
+	bool isCell = all(lessThan(cell, cellShape));
+	if (!isCell && !isGroupAllocated) {
+		return;
+	}
+	uint cellIndex = cell.x + cellShape.x * (cell.y + cellShape.y * (cell.z - cellLayerOffset));
+
+	// classify first; nothing else is computed for cells the surface does not cross
+	float gridValue[8];
 	int cubeindex = 0;
-	if (gridValue[0] < isoLevel) cubeindex |= 1;
-	if (gridValue[1] < isoLevel) cubeindex |= 2;
-	if (gridValue[2] < isoLevel) cubeindex |= 4;
-	if (gridValue[3] < isoLevel) cubeindex |= 8;
-	if (gridValue[4] < isoLevel) cubeindex |= 16;
-	if (gridValue[5] < isoLevel) cubeindex |= 32;
-	if (gridValue[6] < isoLevel) cubeindex |= 64;
-	if (gridValue[7] < isoLevel) cubeindex |= 128;
+	for (int i = 0; i < 8; i++) {
+		gridValue[i] = getTileValue(tileCell + cornerOffset[i]);
+		if (gridValue[i] < isoLevel) cubeindex |= 1 << i;
+	}
 
-	vec3 triVerticeCandidates[12];
-	vec3 triNormalCandidates[12];
+	// cases 0 and 255; CellTriangles is cleared beforehand, so their count of 0 needs no write
+	int edgeCode = isCell && !isOutOfRange ? edgeTable.data[cubeindex] : 0;
+	uint triangleCount = 0;
+	if (edgeCode != 0 && (passMode == 1 || isGroupAllocated)) {
+		while (triTable.data[cubeindex*16 + triangleCount * 3] != -1) {
+			triangleCount++;
+		}
+	}
 
-	int edgeCode = edgeTable.data[cubeindex];
+	// the invocations without triangles take part as well, before they return
+	uint firstGroupTriangle = 0;
+	if (isGroupAllocated) {
+		firstGroupTriangle = allocateGroupTriangles(triangleCount);
+	}
 
-	// generate interpolations
-	for(int i = 0; i < 12; i++) {
-		triVerticeCandidates[i] = interpCubePositions(edgeToGridDict[i][0], edgeToGridDict[i][1]);
-		triNormalCandidates[i] = getNormal(triVerticeCandidates[i]);
+	if (edgeCode == 0) {
+		return;
+	}
+
+	if (passMode == 1) {
+		cellTriangles.data[cellIndex] = triangleCount;
+		return;
+	}
+
+	if (passMode == 5) {
+		uint firstTriangle = cellTriangles.data[cellIndex];
+		for (int i = 0; triTable.data[cubeindex*16 + i] != -1 && firstTriangle + i / 3 < maxTriangles; i += 3) {
+			uint triangleIndices[3];
+			bool isComplete = true;
+			for (int j = 0; j < 3; j++) {
+				int edge = triTable.data[cubeindex*16 + i + j];
+				ivec3 owner = cell + edgeOwnerOffset[edge];
+				uint packedOffset = latticeVertices.data[owner.x + latticeShape.x * (owner.y + latticeShape.y * owner.z)];
+				// the owner's vertices are stored in axis order, so skip those of lower axes
+				uint lowerEdges = (packedOffset >> 29) & ((1u << edgeAxis[edge]) - 1u);
+				triangleIndices[j] = (packedOffset & latticeOffsetMask) + uint(bitCount(lowerEdges));
+				isComplete = isComplete && triangleIndices[j] < maxVertices;
+			}
+			// a triangle whose vertices did not fit collapses onto vertex 0
+			for (int j = 0; j < 3; j++) {
+				outIndices.data[firstTriangle * 3 + i + j] = isComplete ? triangleIndices[j] : 0u;
+			}
+		}
+		return;
 	}
 
 	for (int i = 0; triTable.data[cubeindex*16 + i] != -1; i += 3)
 	{
-		uint index_offset = atomicAdd(outTrianglesCount.data[0], 1);
-
-		uint triVertice1 = triTable.data[cubeindex*16 + i];
-		uint triVertice2 = triTable.data[cubeindex*16 + i+1];
-		uint triVertice3 = triTable.data[cubeindex*16 + i+2];
-
-		outPositions.data[index_offset * 3] = vec4(triVerticeCandidates[triVertice1], 1.0) * sizeCompressRatio;
-		outPositions.data[index_offset * 3+1] = vec4(triVerticeCandidates[triVertice2], 1.0) * sizeCompressRatio;
-		outPositions.data[index_offset * 3+2] = vec4(triVerticeCandidates[triVertice3], 1.0) * sizeCompressRatio;
-		
-		outNormals.data[index_offset * 3] = vec4(triNormalCandidates[triVertice1], 1.0);
-		outNormals.data[index_offset * 3+1] = vec4(triNormalCandidates[triVertice2], 1.0);
-		outNormals.data[index_offset * 3+2] = vec4(triNormalCandidates[triVertice3], 1.0);
+		uint index_offset;
+		if (passMode == 2) {
+			index_offset = cellTriangles.data[cellIndex] + i / 3;
+		}
+		else if (isGroupAllocated) {
+			index_offset = firstGroupTriangle + i / 3;
+		}
+		else {
+			index_offset = atomicAdd(outTrianglesCount.data[0], 1);
+		}
+		if (index_offset >= maxTriangles) {
+			break;
+		}
+
+		// each vertex straight from its edge, so no per edge arrays of positions and normals stay live across the loop
+		for (int j = 0; j < 3; j++) {
+			int edge = triTable.data[cubeindex*16 + i + j];
+			int index1 = edgeToGridDict[edge][0];
+			int index2 = edgeToGridDict[edge][1];
+			vec3 position = interpCubePositions(vec3(cell + cornerOffset[index1]), gridValue[index1], vec3(cell + cornerOffset[index2]), gridValue[index2]);
+			outPositions.data[index_offset * 3 + j] = vec4(position, 1.0) * sizeCompressRatio;
+			outNormals.data[index_offset * 3 + j] = vec4(getNormal(position), 1.0);
+		}
 	}
 }
\ No newline at end of file
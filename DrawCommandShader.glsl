@@ -0,0 +1,25 @@
+#version 430 core
+
+// turn a triangle count that only exists on the GPU into the indirect draw command used by drawMesh,
+// so the CPU never has to read it back
+uniform uint countIndex; // where in TriangleCount the count is
+uniform uint maxTriangles; // what the mesh buffers hold, the count can be higher
+
+layout(std430, binding = 14) readonly buffer TriangleCount {
+	uint data[];
+} triangleCount;
+// DrawElementsIndirectCommand: count, instanceCount, firstIndex, baseVertex, baseInstance;
+// the first four fields read the same as a DrawArraysIndirectCommand
+layout(std430, binding = 15) writeonly buffer DrawCommand {
+	uint data[];
+} drawCommand;
+
+layout(local_size_x = 1, local_size_y = 1, local_size_z = 1) in;
+
+void main() {
+	drawCommand.data[0] = min(triangleCount.data[countIndex], maxTriangles) * 3;
+	drawCommand.data[1] = 1;
+	drawCommand.data[2] = 0;
+	drawCommand.data[3] = 0;
+	drawCommand.data[4] = 0;
+}
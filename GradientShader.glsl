@@ -0,0 +1,34 @@
+#version 430 core
+
+// normalized central-difference gradient of the volume, computed once per loaded volume
+// so that ComputeShader.glsl gets a vertex normal from a single filtered fetch
+
+// see ComputeShader.glsl
+uniform float texelScale;
+uniform float texelOffset;
+
+uniform sampler3D volumeTex;
+layout(rgba8_snorm, binding = 2) uniform writeonly image3D outGradient;
+
+layout(local_size_x = 4, local_size_y = 4, local_size_z = 4) in;
+
+float getImgData(ivec3 texel) {
+	texel = clamp(texel, ivec3(0), textureSize(volumeTex, 0) - 1);
+	return texelFetch(volumeTex, texel, 0).r * texelScale + texelOffset;
+}
+
+void main() {
+	ivec3 texel = ivec3(gl_GlobalInvocationID);
+	if (any(greaterThanEqual(texel, textureSize(volumeTex, 0)))) {
+		return;
+	}
+
+	// pointing from high to low values, like getNormal in ComputeShader.glsl
+	vec3 gradient = vec3(
+		getImgData(texel - ivec3(1, 0, 0)) - getImgData(texel + ivec3(1, 0, 0)),
+		getImgData(texel - ivec3(0, 1, 0)) - getImgData(texel + ivec3(0, 1, 0)),
+		getImgData(texel - ivec3(0, 0, 1)) - getImgData(texel + ivec3(0, 0, 1)));
+
+	float gradientLength = length(gradient);
+	imageStore(outGradient, texel, vec4(gradientLength > 0.0 ? gradient / gradientLength : vec3(0.0), 0.0));
+}
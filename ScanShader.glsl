@@ -0,0 +1,77 @@
+#version 430 core
+
+// exclusive prefix sum over a uint buffer, 1024 values per workgroup. the workgroups run in rows of at most 65535
+// (the smallest dispatch limit GL allows per axis), so block = x + rowLength * y
+// scanStage 0: scan every block in place and write the block total to ScanBlockSums
+// scanStage 1: add the (already scanned) block totals back onto every value of the block
+uniform int scanStage;
+uniform uint valueCount;
+
+layout(std430, binding = 8) buffer ScanValues {
+	uint data[];
+} scanValues;
+layout(std430, binding = 9) buffer ScanBlockSums {
+	uint data[];
+} scanBlockSums;
+
+layout(local_size_x = 512, local_size_y = 1, local_size_z = 1) in;
+
+const uint blockSize = 1024;
+shared uint temp[blockSize];
+
+void main() {
+	uint block = gl_WorkGroupID.x + gl_NumWorkGroups.x * gl_WorkGroupID.y;
+	// the last row is rounded up; the whole workgroup leaves, so no barrier is skipped by part of it
+	if (block * blockSize >= valueCount) {
+		return;
+	}
+	uint localId = gl_LocalInvocationID.x;
+	uint blockStart = block * blockSize;
+	uint ai = localId;
+	uint bi = localId + blockSize / 2;
+
+	if (scanStage == 1) {
+		uint blockOffset = scanBlockSums.data[block];
+		if (blockStart + ai < valueCount) scanValues.data[blockStart + ai] += blockOffset;
+		if (blockStart + bi < valueCount) scanValues.data[blockStart + bi] += blockOffset;
+		return;
+	}
+
+	temp[ai] = blockStart + ai < valueCount ? scanValues.data[blockStart + ai] : 0;
+	temp[bi] = blockStart + bi < valueCount ? scanValues.data[blockStart + bi] : 0;
+
+	// up-sweep: build partial sums in place
+	uint offset = 1;
+	for (uint d = blockSize >> 1; d > 0; d >>= 1) {
+		barrier();
+		if (localId < d) {
+			uint left = offset * (2 * localId + 1) - 1;
+			uint right = offset * (2 * localId + 2) - 1;
+			temp[right] += temp[left];
+		}
+		offset *= 2;
+	}
+
+	// the root holds the block total
+	if (localId == 0) {
+		scanBlockSums.data[block] = temp[blockSize - 1];
+		temp[blockSize - 1] = 0;
+	}
+
+	// down-sweep: turn partial sums into an exclusive scan
+	for (uint d = 1; d < blockSize; d *= 2) {
+		offset >>= 1;
+		barrier();
+		if (localId < d) {
+			uint left = offset * (2 * localId + 1) - 1;
+			uint right = offset * (2 * localId + 2) - 1;
+			uint t = temp[left];
+			temp[left] = temp[right];
+			temp[right] += t;
+		}
+	}
+	barrier();
+
+	if (blockStart + ai < valueCount) scanValues.data[blockStart + ai] = temp[ai];
+	if (blockStart + bi < valueCount) scanValues.data[blockStart + bi] = temp[bi];
+}
@@ -0,0 +1,173 @@
+#pragma once
+#ifndef BRICK_CACHE
+#define BRICK_CACHE
+
+#include "thread_pool.h"
+#include "volume_quantizer.h"
+
+#include <glm/glm.hpp>
+
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+// sparse GPU residency for volumes that do not fit in one texture: every level of the volume pyramid is cut into
+// bricks of brickSide^3 voxels, and only the bricks an extraction reads live in the slots of a fixed size cache
+// texture. a page table per level maps a brick to its slot (slot + 1, or 0 if it is not resident), and the least
+// recently requested bricks give up their slots first. no GL calls in here; main.cpp owns the cache texture,
+// uploads the bricks update() hands back and the page table (see getVolumeTexel in ComputeShader.glsl)
+class BrickCache
+{
+public:
+	static const int brickSide = 32;
+
+	struct Upload
+	{
+		int slot;
+		int level;
+		glm::ivec3 brick;
+	};
+
+	// forget every brick; slotsShape is the number of slots along each side of the cache texture
+	void reset(glm::ivec3 slotsShape)
+	{
+		this->slotsShape = slotsShape;
+		slotKeys.assign((size_t)slotsShape.x * slotsShape.y * slotsShape.z, (uint64_t)emptyKey);
+		slotUses.assign(slotKeys.size(), 0);
+		slots.clear();
+		useCounter = 0;
+		missingCount = 0;
+	}
+
+	glm::ivec3 getSlotsShape() const
+	{
+		return slotsShape;
+	}
+
+	int getSlotCount() const
+	{
+		return (int)slotKeys.size();
+	}
+
+	int getResidentCount() const
+	{
+		return (int)slots.size();
+	}
+
+	// requested bricks that found no slot in the last update
+	int getMissingCount() const
+	{
+		return missingCount;
+	}
+
+	// bricks along each side of a level whose texture is levelTexShape
+	static glm::ivec3 gridShape(glm::ivec3 levelTexShape)
+	{
+		return (levelTexShape + brickSide - 1) / brickSide;
+	}
+
+	// make the bricks of level flagged in requested (one flag per brick of its grid, x fastest) resident, as far as
+	// the slots go: bricks with lower priority values first, slots of bricks not requested this time go least
+	// recently used first. the bricks that got a slot without having one are appended to uploads
+	void update(int level, glm::ivec3 grid, const std::vector<char> &requested, const std::vector<float> &priority,
+		std::vector<Upload> &uploads)
+	{
+		useCounter++;
+		std::vector<int> missing;
+		for (int brick = 0; brick < (int)requested.size(); brick++) {
+			if (!requested[brick]) {
+				continue;
+			}
+			auto slot = slots.find(makeKey(level, brick));
+			if (slot != slots.end()) {
+				slotUses[slot->second] = useCounter;
+			}
+			else {
+				missing.push_back(brick);
+			}
+		}
+		std::stable_sort(missing.begin(), missing.end(), [&](int a, int b) { return priority[a] < priority[b]; });
+
+		// free slots (never used, so 0) first, then the least recently used ones
+		std::vector<int> victims;
+		for (int slot = 0; slot < getSlotCount(); slot++) {
+			if (slotUses[slot] != useCounter) {
+				victims.push_back(slot);
+			}
+		}
+		std::stable_sort(victims.begin(), victims.end(), [&](int a, int b) { return slotUses[a] < slotUses[b]; });
+
+		size_t placed = std::min(missing.size(), victims.size());
+		missingCount = (int)(missing.size() - placed);
+		for (size_t i = 0; i < placed; i++) {
+			int slot = victims[i];
+			if (slotKeys[slot] != emptyKey) {
+				slots.erase(slotKeys[slot]);
+			}
+			slotKeys[slot] = makeKey(level, missing[i]);
+			slotUses[slot] = useCounter;
+			slots[slotKeys[slot]] = slot;
+			int brick = missing[i];
+			uploads.push_back({ slot, level, glm::ivec3(brick % grid.x, (brick / grid.x) % grid.y, brick / (grid.x * grid.y)) });
+		}
+	}
+
+	// page table of level over its grid: slot + 1 for resident bricks, 0 for the others
+	void pageTable(int level, glm::ivec3 grid, std::vector<unsigned int> &table) const
+	{
+		table.assign((size_t)grid.x * grid.y * grid.z, 0);
+		for (const auto &slot : slots) {
+			if ((int)(slot.first >> 32) == level) {
+				table[(uint32_t)slot.first] = slot.second + 1;
+			}
+		}
+	}
+
+	// texel of the cache texture where a slot starts
+	glm::ivec3 slotOrigin(int slot) const
+	{
+		return glm::ivec3(slot % slotsShape.x, (slot / slotsShape.x) % slotsShape.y, slot / (slotsShape.x * slotsShape.y)) * brickSide;
+	}
+
+	// voxels of brick out of a level addressed like its texture (levelTexShape), converted by quantizer into dst;
+	// the part of the brick past the level reads 0
+	static void copyBrick(const unsigned short *levelVals, glm::ivec3 levelTexShape, glm::ivec3 brick, const VolumeQuantizer &quantizer,
+		unsigned char *dst)
+	{
+		size_t bytesPerVoxel = quantizer.bytesPerVoxel();
+		unsigned short row[brickSide];
+		glm::ivec3 origin = brick * brickSide;
+		int rowLength = std::min(brickSide, levelTexShape.x - origin.x);
+		for (int z = 0; z < brickSide; z++) {
+			for (int y = 0; y < brickSide; y++) {
+				memset(row, 0, sizeof(row));
+				if (origin.y + y < levelTexShape.y && origin.z + z < levelTexShape.z) {
+					memcpy(row, levelVals + origin.x + (size_t)levelTexShape.x * (origin.y + y + (size_t)levelTexShape.y * (origin.z + z)),
+						rowLength * sizeof(unsigned short));
+				}
+				quantizer.convert(row, dst + bytesPerVoxel * brickSide * (y + (size_t)brickSide * z), brickSide);
+			}
+		}
+	}
+
+private:
+	static const uint64_t emptyKey = ~0ull;
+
+	glm::ivec3 slotsShape = glm::ivec3(0);
+	// level << 32 | brick index of the brick in a slot, or emptyKey
+	std::vector<uint64_t> slotKeys;
+	// useCounter of the last update that requested the slot's brick
+	std::vector<uint64_t> slotUses;
+	std::unordered_map<uint64_t, int> slots;
+	uint64_t useCounter = 0;
+	int missingCount = 0;
+
+	static uint64_t makeKey(int level, int brick)
+	{
+		return ((uint64_t)level << 32) | (uint32_t)brick;
+	}
+};
+
+#endif
@@ -0,0 +1,514 @@
+#pragma once
+#ifndef BRICKED_VOLUME
+#define BRICKED_VOLUME
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <Windows.h>
+#else
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "thread_pool.h"
+
+#include <glm/glm.hpp>
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <new>
+
+// a volume stored as bricks of brickSide^3 voxels (a .bvol file) instead of one flat raw file, so that only the
+// bricks a surface can pass through have to be read. layout, little endian like the raw files:
+//   header: "MCBRICK1", shape (int32 x y z, as in file_config.txt), int32 brickSide, int32 apron, int32 reserved
+//   index: one BrickEntry per brick, bricks ordered like the texture (x fastest)
+//   data: the bricks, each either 2 * brickSide^3 raw bytes or compressed (see encodeBrick)
+// min/max of a brick are taken over the brick grown by apron voxels on every side, which covers the cells along
+// its faces and the central difference normals there; a brick that is not read is filled with its mean
+class BrickedVolume
+{
+public:
+	static const int brickSide = 32;
+	static const int apron = 4;
+
+	// what to read: bricks whose [min, max] meets [lowestValue, highestValue] (raw voxel values) and that overlap
+	// the voxel box [roiLow, roiHigh] (inclusive, in the x y z of file_config.txt)
+	struct Selection
+	{
+		int lowestValue = 0;
+		int highestValue = 65535;
+		glm::ivec3 roiLow = glm::ivec3(0);
+		glm::ivec3 roiHigh = glm::ivec3(INT_MAX);
+	};
+
+	// like the x y z of file_config.txt (the texture is y x z x x)
+	glm::ivec3 shape;
+	std::vector<unsigned short> voxels;
+	int brickCount = 0;
+	int bricksRead = 0;
+	size_t bytesRead = 0;
+
+	// store a raw volume (inShape as in file_config.txt) as a bricked volume at path, compressing every brick
+	// that gets smaller that way if compress is set
+	static bool write(ThreadPool &pool, const std::string &path, const unsigned short *imgVals, glm::ivec3 inShape, bool compress)
+	{
+		std::ofstream file(path, std::ios::out | std::ios::binary | std::ios::trunc);
+		if (!file) {
+			return false;
+		}
+		glm::ivec3 texShape(inShape.y, inShape.z, inShape.x);
+		glm::ivec3 grid = (texShape + (brickSide - 1)) / (int)brickSide;
+		int count = grid.x * grid.y * grid.z;
+
+		int header[6] = { inShape.x, inShape.y, inShape.z, brickSide, apron, 0 };
+		file.write(magic(), magicSize);
+		file.write((const char *)header, sizeof(header));
+		std::vector<BrickEntry> index(count);
+		uint64_t indexOffset = (uint64_t)file.tellp();
+		file.write((const char *)index.data(), sizeof(BrickEntry) * count);
+		uint64_t offset = indexOffset + sizeof(BrickEntry) * count;
+
+		// a batch of bricks is compressed in parallel, then written in order
+		const int batchBricks = 256;
+		std::vector<std::vector<unsigned char>> stored(std::min(batchBricks, count));
+		for (int first = 0; first < count; first += batchBricks) {
+			int batch = std::min(batchBricks, count - first);
+			pool.parallelFor(0, batch, [&](int i) {
+				int brick = first + i;
+				glm::ivec3 origin = glm::ivec3(brick % grid.x, (brick / grid.x) % grid.y, brick / (grid.x * grid.y)) * (int)brickSide;
+				std::vector<unsigned short> values(brickVoxels);
+				readBrick(imgVals, texShape, origin, values.data());
+				measureBrick(imgVals, texShape, origin, index[brick]);
+				index[brick].flags = 0;
+				if (!compress || !encodeBrick(values.data(), stored[i])) {
+					stored[i].resize(sizeof(unsigned short) * brickVoxels);
+					memcpy(stored[i].data(), values.data(), stored[i].size());
+				}
+				else {
+					index[brick].flags = flagCompressed;
+				}
+			});
+			for (int i = 0; i < batch; i++) {
+				index[first + i].offset = offset;
+				index[first + i].size = (uint32_t)stored[i].size();
+				file.write((const char *)stored[i].data(), stored[i].size());
+				offset += stored[i].size();
+			}
+		}
+		file.seekp(indexOffset);
+		file.write((const char *)index.data(), sizeof(BrickEntry) * count);
+		return (bool)file;
+	}
+
+	// read the bricks of path that selection asks for, in parallel, and fill the others with their mean.
+	// false if the file can not be read, or its header or index do not describe bricks within it
+	bool load(ThreadPool &pool, const std::string &path, const Selection &selection)
+	{
+		FileReader file;
+		if (!file.open(path)) {
+			return false;
+		}
+		char fileMagic[magicSize];
+		int header[6];
+		if (!file.read(0, fileMagic, sizeof(fileMagic)) || memcmp(fileMagic, magic(), magicSize) != 0
+			|| !file.read(magicSize, header, sizeof(header)) || header[3] != brickSide || header[4] != apron) {
+			return false;
+		}
+		// every side at least one voxel, and few enough bricks for an int to count them
+		const int maxGridSide = 1024;
+		for (int axis = 0; axis < 3; axis++) {
+			if (header[axis] <= 0 || header[axis] > maxGridSide * brickSide) {
+				printf("the bricked volume can not have a shape of %d x %d x %d\n", header[0], header[1], header[2]);
+				return false;
+			}
+		}
+		// no more voxels than the largest 3D texture GL implementations commonly take (2048^3) could hold
+		const uint64_t maxVoxels = (uint64_t)2048 * 2048 * 2048;
+		if ((uint64_t)header[0] * header[1] * header[2] > maxVoxels) {
+			printf("the bricked volume can not have a shape of %d x %d x %d\n", header[0], header[1], header[2]);
+			return false;
+		}
+		shape = glm::ivec3(header[0], header[1], header[2]);
+		glm::ivec3 texShape(shape.y, shape.z, shape.x);
+		glm::ivec3 grid = (texShape + (brickSide - 1)) / (int)brickSide;
+		brickCount = grid.x * grid.y * grid.z;
+		uint64_t dataOffset = magicSize + sizeof(header) + sizeof(BrickEntry) * (uint64_t)brickCount;
+		if (dataOffset > file.length()) {
+			printf("the bricked volume is too short for the index of its %d bricks\n", brickCount);
+			return false;
+		}
+		std::vector<BrickEntry> index(brickCount);
+		if (!file.read(magicSize + sizeof(header), index.data(), sizeof(BrickEntry) * brickCount)) {
+			return false;
+		}
+		// a brick lies after the index and within the file, raw at exactly its size or compressed below it
+		for (int brick = 0; brick < brickCount; brick++) {
+			const BrickEntry &entry = index[brick];
+			bool isCompressed = (entry.flags & flagCompressed) != 0;
+			bool isSizeValid = isCompressed ? entry.size > 0 && entry.size < sizeof(unsigned short) * brickVoxels
+				: entry.size == sizeof(unsigned short) * brickVoxels;
+			if (!isSizeValid || entry.offset < dataOffset || entry.offset > file.length() || entry.size > file.length() - entry.offset) {
+				printf("brick %d of the bricked volume has an invalid offset or size\n", brick);
+				return false;
+			}
+		}
+
+		// the region of interest in texture coordinates
+		glm::ivec3 roiLow(selection.roiLow.y, selection.roiLow.z, selection.roiLow.x);
+		glm::ivec3 roiHigh(selection.roiHigh.y, selection.roiHigh.z, selection.roiHigh.x);
+		try {
+			voxels.assign((size_t)texShape.x * texShape.y * texShape.z, 0);
+		}
+		catch (const std::bad_alloc &) {
+			printf("not enough memory for the %d x %d x %d voxels of the bricked volume\n", shape.x, shape.y, shape.z);
+			return false;
+		}
+		std::atomic<int> readCount{ 0 }, failedCount{ 0 };
+		std::atomic<size_t> readBytes{ 0 };
+		pool.parallelFor(0, brickCount, [&](int brick) {
+			const BrickEntry &entry = index[brick];
+			glm::ivec3 origin = glm::ivec3(brick % grid.x, (brick / grid.x) % grid.y, brick / (grid.x * grid.y)) * (int)brickSide;
+			bool isSelected = entry.maxValue >= selection.lowestValue && entry.minValue <= selection.highestValue
+				&& origin.x <= roiHigh.x && origin.y <= roiHigh.y && origin.z <= roiHigh.z
+				&& origin.x + brickSide > roiLow.x && origin.y + brickSide > roiLow.y && origin.z + brickSide > roiLow.z;
+			std::vector<unsigned short> values(brickVoxels, entry.fillValue);
+			if (isSelected) {
+				std::vector<unsigned char> stored(entry.size);
+				bool isRead = file.read(entry.offset, stored.data(), stored.size());
+				if (isRead && (entry.flags & flagCompressed)) {
+					isRead = decodeBrick(stored.data(), stored.size(), values.data());
+				}
+				else if (isRead) {
+					memcpy(values.data(), stored.data(), stored.size());
+				}
+				if (isRead) {
+					readCount++;
+					readBytes += stored.size();
+				}
+				else {
+					std::fill(values.begin(), values.end(), entry.fillValue);
+					failedCount++;
+				}
+			}
+			writeBrick(values.data(), texShape, origin, voxels.data());
+		});
+		bricksRead = readCount;
+		bytesRead = readBytes;
+		if (failedCount > 0) {
+			printf("%d bricks could not be read and are filled with their mean\n", (int)failedCount);
+		}
+		return true;
+	}
+
+	// the file ends in .bvol
+	static bool isBrickedPath(const std::string &path)
+	{
+		const std::string extension = ".bvol";
+		return path.size() >= extension.size() && path.compare(path.size() - extension.size(), extension.size(), extension) == 0;
+	}
+
+private:
+	static const int brickVoxels = brickSide * brickSide * brickSide;
+	static const size_t magicSize = 8;
+	static const uint16_t flagCompressed = 1;
+
+	struct BrickEntry
+	{
+		uint64_t offset;
+		uint32_t size;
+		uint16_t minValue, maxValue;
+		// mean of the brick, for reading it without reading it
+		uint16_t fillValue;
+		uint16_t flags;
+		uint32_t reserved;
+	};
+
+	static const char *magic()
+	{
+		return "MCBRICK1";
+	}
+
+	// positional reads that several threads can issue at once
+	class FileReader
+	{
+	public:
+		~FileReader()
+		{
+#ifdef _WIN32
+			if (handle != INVALID_HANDLE_VALUE) {
+				CloseHandle(handle);
+			}
+#else
+			if (fd >= 0) {
+				::close(fd);
+			}
+#endif
+		}
+
+		bool open(const std::string &path)
+		{
+#ifdef _WIN32
+			handle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, NULL);
+			LARGE_INTEGER fileSize;
+			if (handle == INVALID_HANDLE_VALUE || !GetFileSizeEx(handle, &fileSize)) {
+				return false;
+			}
+			fileLength = (uint64_t)fileSize.QuadPart;
+			return true;
+#else
+			fd = ::open(path.c_str(), O_RDONLY);
+			struct stat fileStat;
+			if (fd < 0 || fstat(fd, &fileStat) != 0) {
+				return false;
+			}
+			fileLength = (uint64_t)fileStat.st_size;
+			return true;
+#endif
+		}
+
+		// bytes in the file
+		uint64_t length() const
+		{
+			return fileLength;
+		}
+
+		bool read(uint64_t offset, void *dst, size_t size) const
+		{
+			char *bytes = (char *)dst;
+			while (size > 0) {
+#ifdef _WIN32
+				OVERLAPPED overlapped = {};
+				overlapped.Offset = (DWORD)offset;
+				overlapped.OffsetHigh = (DWORD)(offset >> 32);
+				DWORD done = 0;
+				if (!ReadFile(handle, bytes, (DWORD)std::min(size, (size_t)1 << 30), &done, &overlapped) || done == 0) {
+					return false;
+				}
+#else
+				ssize_t done = pread(fd, bytes, size, (off_t)offset);
+				if (done <= 0) {
+					return false;
+				}
+#endif
+				bytes += done;
+				offset += done;
+				size -= done;
+			}
+			return true;
+		}
+
+	private:
+#ifdef _WIN32
+		HANDLE handle = INVALID_HANDLE_VALUE;
+#else
+		int fd = -1;
+#endif
+		uint64_t fileLength = 0;
+	};
+
+	// copy the brick at origin (texture coordinates) out of a volume; voxels past the volume read 0
+	static void readBrick(const unsigned short *imgVals, glm::ivec3 texShape, glm::ivec3 origin, unsigned short *dst)
+	{
+		int rowLength = std::min((int)brickSide, texShape.x - origin.x);
+		for (int z = 0; z < brickSide; z++) {
+			for (int y = 0; y < brickSide; y++) {
+				unsigned short *row = dst + brickSide * (y + brickSide * z);
+				memset(row, 0, sizeof(unsigned short) * brickSide);
+				if (origin.y + y < texShape.y && origin.z + z < texShape.z) {
+					memcpy(row, imgVals + origin.x + (size_t)texShape.x * (origin.y + y + (size_t)texShape.y * (origin.z + z)),
+						sizeof(unsigned short) * rowLength);
+				}
+			}
+		}
+	}
+
+	// the inverse of readBrick, leaving out what lies past the volume
+	static void writeBrick(const unsigned short *src, glm::ivec3 texShape, glm::ivec3 origin, unsigned short *imgVals)
+	{
+		int rowLength = std::min((int)brickSide, texShape.x - origin.x);
+		for (int z = 0; z < brickSide && origin.z + z < texShape.z; z++) {
+			for (int y = 0; y < brickSide && origin.y + y < texShape.y; y++) {
+				memcpy(imgVals + origin.x + (size_t)texShape.x * (origin.y + y + (size_t)texShape.y * (origin.z + z)),
+					src + brickSide * (y + brickSide * z), sizeof(unsigned short) * rowLength);
+			}
+		}
+	}
+
+	// min/max over the brick grown by apron, and the mean over the brick itself
+	static void measureBrick(const unsigned short *imgVals, glm::ivec3 texShape, glm::ivec3 origin, BrickEntry &entry)
+	{
+		glm::ivec3 low = glm::max(origin - (int)apron, glm::ivec3(0));
+		glm::ivec3 high = glm::min(origin + (brickSide + apron), texShape);
+		glm::ivec3 brickHigh = glm::min(origin + (int)brickSide, texShape);
+		unsigned short minValue = 65535, maxValue = 0;
+		uint64_t sum = 0;
+		for (int z = low.z; z < high.z; z++) {
+			for (int y = low.y; y < high.y; y++) {
+				const unsigned short *row = imgVals + (size_t)texShape.x * (y + (size_t)texShape.y * z);
+				bool isInBrick = z >= origin.z && z < brickHigh.z && y >= origin.y && y < brickHigh.y;
+				for (int x = low.x; x < high.x; x++) {
+					minValue = std::min(minValue, row[x]);
+					maxValue = std::max(maxValue, row[x]);
+					if (isInBrick && x >= origin.x && x < brickHigh.x) {
+						sum += row[x];
+					}
+				}
+			}
+		}
+		glm::ivec3 inside = brickHigh - origin;
+		entry.minValue = minValue;
+		entry.maxValue = maxValue;
+		entry.fillValue = (uint16_t)((sum + (uint64_t)inside.x * inside.y * inside.z / 2) / ((uint64_t)inside.x * inside.y * inside.z));
+	}
+
+	// delta to the previous voxel (zigzag, so small steps either way stay small), the low bytes of all deltas and
+	// then the high bytes (mostly 0 in smooth data), compressed as LZ77 sequences in the way of LZ4: a token with
+	// 4 bits of literal count and 4 bits of match length - 4 (15 continues in further bytes of up to 255), the
+	// literals, and a 2 byte offset back to the match. the last sequence only has literals.
+	// false if that comes out no smaller than the raw brick
+	static bool encodeBrick(const unsigned short *values, std::vector<unsigned char> &dst)
+	{
+		std::vector<unsigned char> planes(2 * brickVoxels);
+		unsigned short previous = 0;
+		for (int i = 0; i < brickVoxels; i++) {
+			int16_t delta = (int16_t)(values[i] - previous);
+			uint16_t zigzag = (uint16_t)(((uint16_t)delta << 1) ^ (uint16_t)(delta >> 15));
+			planes[i] = (unsigned char)zigzag;
+			planes[brickVoxels + i] = (unsigned char)(zigzag >> 8);
+			previous = values[i];
+		}
+
+		const int n = (int)planes.size();
+		const unsigned char *src = planes.data();
+		dst.clear();
+		dst.reserve(n);
+		std::vector<int> table(1 << 14, -1);
+		int anchor = 0;
+		int i = 0;
+		while (i + 4 <= n) {
+			uint32_t sequence;
+			memcpy(&sequence, src + i, 4);
+			uint32_t hash = (sequence * 2654435761u) >> 18;
+			int candidate = table[hash];
+			table[hash] = i;
+			if (candidate < 0 || i - candidate > 65535 || memcmp(src + candidate, src + i, 4) != 0) {
+				i++;
+				continue;
+			}
+			int length = 4;
+			while (i + length < n && src[candidate + length] == src[i + length]) {
+				length++;
+			}
+			writeSequence(dst, src + anchor, i - anchor, i - candidate, length);
+			i += length;
+			anchor = i;
+			if (dst.size() >= (size_t)n) {
+				return false;
+			}
+		}
+		writeSequence(dst, src + anchor, n - anchor, 0, 0);
+		return dst.size() < (size_t)n;
+	}
+
+	static bool decodeBrick(const unsigned char *src, size_t size, unsigned short *values)
+	{
+		std::vector<unsigned char> planes(2 * brickVoxels);
+		size_t in = 0, out = 0;
+		while (in < size) {
+			unsigned char token = src[in++];
+			size_t literals = token >> 4;
+			if (!readLength(src, size, in, literals) || literals > size - in || literals > planes.size() - out) {
+				return false;
+			}
+			memcpy(planes.data() + out, src + in, literals);
+			in += literals;
+			out += literals;
+			if (in == size) {
+				break;
+			}
+			if (size - in < 2) {
+				return false;
+			}
+			size_t offset = src[in] | (src[in + 1] << 8);
+			in += 2;
+			size_t length = token & 15;
+			if (!readLength(src, size, in, length)) {
+				return false;
+			}
+			length += 4;
+			if (offset == 0 || offset > out || length > planes.size() - out) {
+				return false;
+			}
+			// byte by byte: the match may overlap what it writes
+			for (size_t i = 0; i < length; i++, out++) {
+				planes[out] = planes[out - offset];
+			}
+		}
+		if (out != planes.size()) {
+			return false;
+		}
+
+		unsigned short previous = 0;
+		for (int i = 0; i < brickVoxels; i++) {
+			uint16_t zigzag = (uint16_t)(planes[i] | (planes[brickVoxels + i] << 8));
+			uint16_t delta = (uint16_t)((zigzag >> 1) ^ (uint16_t)(0 - (zigzag & 1)));
+			previous = (unsigned short)(previous + delta);
+			values[i] = previous;
+		}
+		return true;
+	}
+
+	static void writeLength(std::vector<unsigned char> &dst, size_t length)
+	{
+		for (; length >= 255; length -= 255) {
+			dst.push_back(255);
+		}
+		dst.push_back((unsigned char)length);
+	}
+
+	// a 4 bit length of 15 continues in the following bytes
+	static bool readLength(const unsigned char *src, size_t size, size_t &in, size_t &length)
+	{
+		if (length != 15) {
+			return true;
+		}
+		unsigned char more;
+		do {
+			if (in >= size) {
+				return false;
+			}
+			more = src[in++];
+			length += more;
+		} while (more == 255);
+		return true;
+	}
+
+	// length 0: literals only, the last sequence
+	static void writeSequence(std::vector<unsigned char> &dst, const unsigned char *literals, size_t literalCount, size_t offset, size_t length)
+	{
+		size_t matchLength = length > 0 ? length - 4 : 0;
+		dst.push_back((unsigned char)((std::min(literalCount, (size_t)15) << 4) | std::min(matchLength, (size_t)15)));
+		if (literalCount >= 15) {
+			writeLength(dst, literalCount - 15);
+		}
+		dst.insert(dst.end(), literals, literals + literalCount);
+		if (length == 0) {
+			return;
+		}
+		dst.push_back((unsigned char)offset);
+		dst.push_back((unsigned char)(offset >> 8));
+		if (matchLength >= 15) {
+			writeLength(dst, matchLength - 15);
+		}
+	}
+};
+
+#endif
@@ -0,0 +1,134 @@
+#pragma once
+#ifndef BUFFER_POOL
+#define BUFFER_POOL
+
+#include <glad/glad.h>
+
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <cstring>
+
+// glBufferStorage is core since 4.4; a 4.3 context can still have it as ARB_buffer_storage. asked once
+inline bool contextHasBufferStorage()
+{
+	static int support = -1;
+	if (support < 0) {
+		GLint major = 0, minor = 0, extensionCount = 0;
+		glGetIntegerv(GL_MAJOR_VERSION, &major);
+		glGetIntegerv(GL_MINOR_VERSION, &minor);
+		support = major > 4 || (major == 4 && minor >= 4) ? 1 : 0;
+		glGetIntegerv(GL_NUM_EXTENSIONS, &extensionCount);
+		for (GLint i = 0; i < extensionCount && support == 0; i++) {
+			if (strcmp((const char *)glGetStringi(GL_EXTENSIONS, i), "GL_ARB_buffer_storage") == 0) {
+				support = 1;
+			}
+		}
+	}
+	return support == 1;
+}
+
+// GL buffers that outlive the extraction they were made for: a buffer given back through release() is handed out
+// again by acquire() to the next request it is large enough for, so once the buffers have grown to the largest mesh
+// so far, moving the sliders allocates nothing. buffers only grow; their storage is immutable (glBufferStorage)
+// where the context has it, and always allows glBufferSubData
+class BufferPool
+{
+public:
+	// a buffer of at least size bytes that nobody else holds
+	GLuint acquire(GLsizeiptr size)
+	{
+		// the smallest free buffer that is large enough
+		auto best = freeBuffers.end();
+		for (auto buffer = freeBuffers.begin(); buffer != freeBuffers.end(); ++buffer) {
+			if (capacities[*buffer] >= size && (best == freeBuffers.end() || capacities[*buffer] < capacities[*best])) {
+				best = buffer;
+			}
+		}
+		if (best != freeBuffers.end()) {
+			GLuint buffer = *best;
+			freeBuffers.erase(best);
+			return buffer;
+		}
+
+		// none is: the largest free one, the closest in size, makes way for a new one with room to grow
+		if (!freeBuffers.empty()) {
+			auto largest = std::max_element(freeBuffers.begin(), freeBuffers.end(),
+				[&](GLuint a, GLuint b) { return capacities[a] < capacities[b]; });
+			deleteBuffer(*largest);
+			freeBuffers.erase(largest);
+		}
+		return createBuffer(grownCapacity(size));
+	}
+
+	// hand buffer (from acquire, or 0) back; commands already queued on it still see its contents
+	void release(GLuint buffer)
+	{
+		if (buffer != 0) {
+			freeBuffers.push_back(buffer);
+		}
+	}
+
+	GLsizeiptr capacity(GLuint buffer) const
+	{
+		auto found = capacities.find(buffer);
+		return found == capacities.end() ? 0 : found->second;
+	}
+
+	// bytes of all buffers, held or free
+	size_t allocatedBytes() const
+	{
+		size_t bytes = 0;
+		for (const auto &buffer : capacities) {
+			bytes += (size_t)buffer.second;
+		}
+		return bytes;
+	}
+
+	// delete the free buffers
+	void trim()
+	{
+		for (GLuint buffer : freeBuffers) {
+			deleteBuffer(buffer);
+		}
+		freeBuffers.clear();
+	}
+
+private:
+	// smallest buffer, and the room a new one gets on top of what was asked for
+	static const GLsizeiptr minCapacity = 64 << 10;
+	static const int growthDivisor = 4;
+
+	std::vector<GLuint> freeBuffers;
+	std::unordered_map<GLuint, GLsizeiptr> capacities;
+
+	static GLsizeiptr grownCapacity(GLsizeiptr size)
+	{
+		GLsizeiptr capacity = size + size / growthDivisor;
+		return std::max((capacity + minCapacity - 1) / minCapacity * minCapacity, (GLsizeiptr)minCapacity);
+	}
+
+	GLuint createBuffer(GLsizeiptr capacity)
+	{
+		GLuint buffer;
+		glGenBuffers(1, &buffer);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+		// without glBufferStorage, glBufferData still only runs once per buffer
+		if (contextHasBufferStorage()) {
+			glBufferStorage(GL_COPY_WRITE_BUFFER, capacity, nullptr, GL_DYNAMIC_STORAGE_BIT);
+		}
+		else {
+			glBufferData(GL_COPY_WRITE_BUFFER, capacity, nullptr, GL_DYNAMIC_DRAW);
+		}
+		capacities[buffer] = capacity;
+		return buffer;
+	}
+
+	void deleteBuffer(GLuint buffer)
+	{
+		glDeleteBuffers(1, &buffer);
+		capacities.erase(buffer);
+	}
+};
+
+#endif
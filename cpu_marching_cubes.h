@@ -0,0 +1,214 @@
+#pragma once
+#ifndef CPU_MARCHING_CUBES
+#define CPU_MARCHING_CUBES
+
+#include "thread_pool.h"
+#include "volume_pyramid.h"
+#include "extraction_grid.h"
+
+#include <glm/glm.hpp>
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <atomic>
+
+// the same tables the compute shader gets through its EdgeTable / triTable SSBOs (see main.h)
+extern int edgeTable[256];
+extern int triTable[];
+
+// CPU counterpart of ComputeShader.glsl; no GL calls in here, so it also runs on machines without a GPU.
+// the volume is addressed exactly like the R16 texture made by genTexImage3D:
+// texel (x, y, z) lives at x + y * inShape.y + z * inShape.y * inShape.z
+// grid.pyramidLevel is the level of pyramid that is sampled, the pyramidLevel uniform in the shader
+class CpuVolumeSampler
+{
+public:
+	CpuVolumeSampler(const VolumePyramid &pyramid, const ExtractionGrid &grid, int maxImgValue)
+		: imgVals(pyramid.getLevel(grid.pyramidLevel)), texShape(pyramid.getTexShape(grid.pyramidLevel)),
+		level(grid.pyramidLevel), cubeRatio(grid.cubeRatio), gradientScale(grid.gradientScale)
+	{
+		levelScale = 1.0f / (float)(1 << level);
+		// r16 texels are normalized by 65535 before the shader rescales them by 65536 / maxImgValue
+		valueScale = 65536.0f / (65535.0f * maxImgValue);
+	}
+
+	// getInputImgData in the shader
+	float getInputImgData(int x, int y, int z, bool &isOutOfRange) const
+	{
+		if (x >= texShape.x || y >= texShape.y || z >= texShape.z || x < 0 || y < 0 || z < 0) {
+			isOutOfRange = true;
+			return 0.0f;
+		}
+		return imgVals[x + (size_t)texShape.x * (y + (size_t)texShape.y * z)] * valueScale;
+	}
+
+	// getInterpImgData in the shader: manual trilinear filtering at a grid position
+	float getInterpImgData(glm::vec3 query, bool &isOutOfRange) const
+	{
+		query = query * cubeRatio;
+		if (level > 0) {
+			// voxel centers of a coarser level lie between those of the level below
+			query = glm::max((query + 0.5f) * levelScale - 0.5f, glm::vec3(0.0f));
+		}
+		int imgIntX = (int)query.x;
+		int imgIntY = (int)query.y;
+		int imgIntZ = (int)query.z;
+
+		float v1 = getInputImgData(imgIntX,     imgIntY,     imgIntZ,     isOutOfRange);
+		float v2 = getInputImgData(imgIntX + 1, imgIntY,     imgIntZ,     isOutOfRange);
+		float v3 = getInputImgData(imgIntX,     imgIntY + 1, imgIntZ,     isOutOfRange);
+		float v4 = getInputImgData(imgIntX + 1, imgIntY + 1, imgIntZ,     isOutOfRange);
+		float v5 = getInputImgData(imgIntX,     imgIntY,     imgIntZ + 1, isOutOfRange);
+		float v6 = getInputImgData(imgIntX + 1, imgIntY,     imgIntZ + 1, isOutOfRange);
+		float v7 = getInputImgData(imgIntX,     imgIntY + 1, imgIntZ + 1, isOutOfRange);
+		float v8 = getInputImgData(imgIntX + 1, imgIntY + 1, imgIntZ + 1, isOutOfRange);
+
+		float x = query.x - imgIntX;
+		float y = query.y - imgIntY;
+		float z = query.z - imgIntZ;
+
+		float s = (v1 * (1 - x) + v2 * x) * (1 - y) + (v3 * (1 - x) + v4 * x) * y;
+		float t = (v5 * (1 - x) + v6 * x) * (1 - y) + (v7 * (1 - x) + v8 * x) * y;
+		return s * (1 - z) + t * z;
+	}
+
+	// getNormal in the shader: central differences 2.1 voxels apart
+	glm::vec3 getNormal(glm::vec3 position) const
+	{
+		bool ignored = false;
+		glm::vec3 delta = 2.1f / cubeRatio;
+		float vx1 = getInterpImgData(glm::vec3(position.x - delta.x, position.y, position.z), ignored);
+		float vx2 = getInterpImgData(glm::vec3(position.x + delta.x, position.y, position.z), ignored);
+		float vy1 = getInterpImgData(glm::vec3(position.x, position.y - delta.y, position.z), ignored);
+		float vy2 = getInterpImgData(glm::vec3(position.x, position.y + delta.y, position.z), ignored);
+		float vz1 = getInterpImgData(glm::vec3(position.x, position.y, position.z - delta.z), ignored);
+		float vz2 = getInterpImgData(glm::vec3(position.x, position.y, position.z + delta.z), ignored);
+		return glm::normalize(glm::vec3(vx1 - vx2, vy1 - vy2, vz1 - vz2) * gradientScale);
+	}
+
+private:
+	const unsigned short *imgVals;
+	glm::ivec3 texShape;
+	int level;
+	glm::vec3 cubeRatio;
+	glm::vec3 gradientScale;
+	float levelScale;
+	float valueScale;
+};
+
+// extract the iso surface on the CPU; output layout matches the OutPositions / OutNormals SSBOs
+// (3 vec4 per triangle, positions scaled by sizeCompressRatio) so it can go straight into the VBO.
+// every z-slab of cells is one task for the pool and slabs are concatenated in order,
+// so the triangle order is the same however many threads run.
+// grid.pyramidLevel is the level of pyramid the grid samples, 0 for the volume itself.
+// if isCancelled is given and becomes true, the remaining slabs are skipped and the output is left empty
+void createMarchingCubesCPU(ThreadPool &pool, const VolumePyramid &pyramid, const ExtractionGrid &grid, const int maxImgValue,
+	const float isoLevel, std::vector<glm::vec4> &outPositions, std::vector<glm::vec4> &outNormals,
+	const std::atomic<bool> *isCancelled = nullptr)
+{
+	static const int cornerOffsets[8][3] = {
+		{0, 0, 0}, {1, 0, 0}, {1, 1, 0}, {0, 1, 0},
+		{0, 0, 1}, {1, 0, 1}, {1, 1, 1}, {0, 1, 1}
+	};
+	static const int edgeToGridDict[12][2] = {
+		{0, 1}, {1, 2}, {2, 3}, {0, 3},
+		{4, 5}, {5, 6}, {6, 7}, {4, 7},
+		{0, 4}, {1, 5}, {2, 6}, {3, 7}
+	};
+
+	const glm::ivec3 cellShape = grid.cellShape;
+	const float sizeCompressRatio = grid.sizeCompressRatio;
+	CpuVolumeSampler sampler(pyramid, grid, maxImgValue);
+
+	std::vector<std::vector<glm::vec4>> slabPositions(cellShape.z);
+	std::vector<std::vector<glm::vec4>> slabNormals(cellShape.z);
+
+	const glm::ivec3 latticeShape = grid.latticeShape();
+	pool.parallelFor(0, cellShape.z, [&](int z) {
+		if (isCancelled != nullptr && *isCancelled) {
+			return;
+		}
+
+		// grid values of the two lattice planes bounding this slab; each one is sampled once
+		// instead of once per touching cube
+		std::vector<float> latticeValue(2 * latticeShape.x * latticeShape.y);
+		std::vector<char> latticeOutOfRange(latticeValue.size());
+		for (int dz = 0; dz < 2; dz++) {
+			for (int y = 0; y < latticeShape.y; y++) {
+				for (int x = 0; x < latticeShape.x; x++) {
+					bool isOutOfRange = false;
+					int index = x + latticeShape.x * (y + latticeShape.y * dz);
+					latticeValue[index] = sampler.getInterpImgData(glm::vec3(x, y, z + dz), isOutOfRange);
+					latticeOutOfRange[index] = isOutOfRange;
+				}
+			}
+		}
+
+		std::vector<glm::vec4> &positions = slabPositions[z];
+		std::vector<glm::vec4> &normals = slabNormals[z];
+		float gridValue[8];
+		glm::vec3 gridCoord[8];
+		glm::vec3 triVerticeCandidates[12];
+		glm::vec3 triNormalCandidates[12];
+
+		for (int y = 0; y < cellShape.y; y++) {
+			for (int x = 0; x < cellShape.x; x++) {
+				bool isOutOfRange = false;
+				int cubeindex = 0;
+				for (int i = 0; i < 8; i++) {
+					int index = (x + cornerOffsets[i][0]) + latticeShape.x * ((y + cornerOffsets[i][1]) + latticeShape.y * cornerOffsets[i][2]);
+					gridValue[i] = latticeValue[index];
+					isOutOfRange |= latticeOutOfRange[index] != 0;
+					gridCoord[i] = glm::vec3(x + cornerOffsets[i][0], y + cornerOffsets[i][1], z + cornerOffsets[i][2]);
+					if (gridValue[i] < isoLevel) cubeindex |= 1 << i;
+				}
+				if (isOutOfRange) {
+					continue;
+				}
+
+				int edgeCode = edgeTable[cubeindex];
+				if (edgeCode == 0) {
+					continue;
+				}
+
+				// only the edges this cube case actually cuts
+				for (int i = 0; i < 12; i++) {
+					if ((edgeCode & (1 << i)) == 0) {
+						continue;
+					}
+					int index1 = edgeToGridDict[i][0];
+					int index2 = edgeToGridDict[i][1];
+					float v1Weight = std::abs(gridValue[index2] - isoLevel) / std::abs(gridValue[index2] - gridValue[index1]);
+					triVerticeCandidates[i] = gridCoord[index1] * v1Weight + gridCoord[index2] * (1 - v1Weight);
+					triNormalCandidates[i] = sampler.getNormal(triVerticeCandidates[i]);
+				}
+
+				for (int i = 0; triTable[cubeindex * 16 + i] != -1; i++) {
+					int triVertice = triTable[cubeindex * 16 + i];
+					positions.push_back(glm::vec4(triVerticeCandidates[triVertice], 1.0f) * sizeCompressRatio);
+					normals.push_back(glm::vec4(triNormalCandidates[triVertice], 1.0f));
+				}
+			}
+		}
+	});
+
+	outPositions.clear();
+	outNormals.clear();
+	if (isCancelled != nullptr && *isCancelled) {
+		return;
+	}
+
+	size_t totalVertices = 0;
+	for (int z = 0; z < cellShape.z; z++) {
+		totalVertices += slabPositions[z].size();
+	}
+	outPositions.reserve(totalVertices);
+	outNormals.reserve(totalVertices);
+	for (int z = 0; z < cellShape.z; z++) {
+		outPositions.insert(outPositions.end(), slabPositions[z].begin(), slabPositions[z].end());
+		outNormals.insert(outNormals.end(), slabNormals[z].begin(), slabNormals[z].end());
+	}
+}
+
+#endif
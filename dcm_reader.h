@@ -5,16 +5,244 @@
 #define NOMINMAX
 #include <Windows.h>
 #include <imebra/imebra.h>
-#include <string>
 
-void readDcm(std::string path) {
-	// read dicom
+#ifndef _WIN32
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+
+#include "thread_pool.h"
 
-	
-	imebra::DataSet loadedDataSet(imebra::CodecFactory::load(path));
-	imebra::Image image(loadedDataSet.getImageApplyModalityTransform(0));
-	// https://stackoverflow.com/questions/60942986/c-reading-16bit-binary-data-from-raw-img-and-store-them-in-vector
+#include <glm/glm.hpp>
 
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+
+// the files in directory, or false if it is not a directory
+inline bool listDirectory(const std::string &directory, std::vector<std::string> &files)
+{
+	files.clear();
+#ifdef _WIN32
+	DWORD attributes = GetFileAttributesA(directory.c_str());
+	if (attributes == INVALID_FILE_ATTRIBUTES || !(attributes & FILE_ATTRIBUTE_DIRECTORY)) {
+		return false;
+	}
+	WIN32_FIND_DATAA findData;
+	HANDLE find = FindFirstFileA((directory + "/*").c_str(), &findData);
+	if (find == INVALID_HANDLE_VALUE) {
+		return true;
+	}
+	do {
+		if (!(findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+			files.push_back(directory + "/" + findData.cFileName);
+		}
+	} while (FindNextFileA(find, &findData));
+	FindClose(find);
+#else
+	DIR *dir = opendir(directory.c_str());
+	if (dir == nullptr) {
+		return false;
+	}
+	while (dirent *entry = readdir(dir)) {
+		std::string file = directory + "/" + entry->d_name;
+		struct stat fileStat;
+		if (stat(file.c_str(), &fileStat) == 0 && S_ISREG(fileStat.st_mode)) {
+			files.push_back(file);
+		}
+	}
+	closedir(dir);
+#endif
+	std::sort(files.begin(), files.end());
+	return true;
 }
 
-#endif
\ No newline at end of file
+// a DICOM series (one directory of single-slice files) decoded into 16 bit voxels laid out like a raw volume,
+// so that everything after loading (texture upload, CPU engine) cannot tell the two apart.
+// headers are read first to sort the slices along the scan direction, then the pixel data of all slices is decoded
+// in parallel, each slice straight into its own layer of the volume with the modality transform applied
+class DicomSeries
+{
+public:
+	// like the x y z of file_config.txt: slices, columns, rows (the texture is columns x rows x slices)
+	glm::ivec3 shape;
+	// mm between neighbouring voxels along the same axes as shape
+	glm::vec3 spacing;
+	// stored voxel = (modality value - valueOffset) * valueScale, modality value being e.g. Hounsfield units
+	double valueOffset = 0.0;
+	double valueScale = 1.0;
+	std::vector<unsigned short> voxels;
+
+	bool load(ThreadPool &pool, const std::string &directory)
+	{
+		std::vector<std::string> files;
+		if (!listDirectory(directory, files) || files.empty()) {
+			return false;
+		}
+
+		// headers only: the pixel data is larger than this and stays on disk for now
+		std::vector<Slice> slices(files.size());
+		pool.parallelFor(0, (int)files.size(), [&](int i) {
+			slices[i].path = files[i];
+			slices[i].isValid = readHeader(slices[i]);
+		});
+		slices.erase(std::remove_if(slices.begin(), slices.end(), [](const Slice &slice) { return !slice.isValid; }), slices.end());
+		if (slices.empty()) {
+			return false;
+		}
+
+		// along the normal of the image plane, or by instance number if a slice has no position
+		bool hasPositions = std::all_of(slices.begin(), slices.end(), [](const Slice &slice) { return slice.hasPosition; });
+		std::sort(slices.begin(), slices.end(), [&](const Slice &a, const Slice &b) {
+			return hasPositions ? a.location < b.location : a.instanceNumber < b.instanceNumber;
+		});
+
+		const Slice &first = slices.front();
+		shape = glm::ivec3((int)slices.size(), first.columns, first.rows);
+		double sliceSpacing = slices.size() > 1 && hasPositions
+			? (slices.back().location - first.location) / (slices.size() - 1) : first.sliceThickness;
+		spacing = glm::vec3((float)std::abs(sliceSpacing), (float)first.pixelSpacing.y, (float)first.pixelSpacing.x);
+		chooseValueMapping(first);
+
+		size_t sliceVoxels = (size_t)first.columns * first.rows;
+		voxels.assign(sliceVoxels * slices.size(), 0);
+		std::atomic<int> failedSlices{ 0 };
+		pool.parallelFor(0, (int)slices.size(), [&](int i) {
+			if (slices[i].columns != first.columns || slices[i].rows != first.rows || !decodeSlice(slices[i], voxels.data() + sliceVoxels * i)) {
+				failedSlices++;
+			}
+		});
+		if (failedSlices > 0) {
+			printf("%d of %d slices could not be decoded and are left empty\n", (int)failedSlices, (int)slices.size());
+		}
+		return true;
+	}
+
+private:
+	struct Slice
+	{
+		std::string path;
+		bool isValid = false;
+		int rows = 0, columns = 0;
+		bool hasPosition = false;
+		// position along the normal of the image plane
+		double location = 0.0;
+		int instanceNumber = 0;
+		glm::dvec2 pixelSpacing = glm::dvec2(1.0);
+		double sliceThickness = 1.0;
+		double rescaleSlope = 1.0, rescaleIntercept = 0.0;
+		int bitsStored = 16;
+		bool isSigned = false;
+	};
+
+	static imebra::TagId tag(std::uint16_t group, std::uint16_t element)
+	{
+		return imebra::TagId(group, element);
+	}
+
+	static bool readHeader(Slice &slice)
+	{
+		try {
+			imebra::DataSet dataSet(imebra::CodecFactory::load(slice.path, 2048));
+			slice.rows = (int)dataSet.getDouble(tag(0x0028, 0x0010), 0, 0.0);
+			slice.columns = (int)dataSet.getDouble(tag(0x0028, 0x0011), 0, 0.0);
+			if (slice.rows <= 0 || slice.columns <= 0) {
+				return false;
+			}
+
+			slice.instanceNumber = (int)dataSet.getDouble(tag(0x0020, 0x0013), 0, 0.0);
+			slice.pixelSpacing = glm::dvec2(dataSet.getDouble(tag(0x0028, 0x0030), 0, 1.0), dataSet.getDouble(tag(0x0028, 0x0030), 1, 1.0));
+			slice.sliceThickness = dataSet.getDouble(tag(0x0018, 0x0050), 0, 1.0);
+			slice.rescaleSlope = dataSet.getDouble(tag(0x0028, 0x1053), 0, 1.0);
+			slice.rescaleIntercept = dataSet.getDouble(tag(0x0028, 0x1052), 0, 0.0);
+			slice.bitsStored = (int)dataSet.getDouble(tag(0x0028, 0x0101), 0, 16.0);
+			slice.isSigned = dataSet.getDouble(tag(0x0028, 0x0103), 0, 0.0) != 0.0;
+
+			// image position projected on row direction x column direction
+			const double missing = 1e30;
+			glm::dvec3 position, row, column;
+			for (int i = 0; i < 3; i++) {
+				position[i] = dataSet.getDouble(tag(0x0020, 0x0032), i, missing);
+				row[i] = dataSet.getDouble(tag(0x0020, 0x0037), i, missing);
+				column[i] = dataSet.getDouble(tag(0x0020, 0x0037), i + 3, missing);
+			}
+			slice.hasPosition = position.x != missing && position.y != missing && position.z != missing;
+			glm::dvec3 normal(0.0, 0.0, 1.0);
+			if (row.x != missing && column.z != missing) {
+				normal = glm::cross(row, column);
+			}
+			slice.location = glm::dot(position, normal);
+			return true;
+		}
+		catch (const std::exception &) {
+			// not a DICOM file, or one without an image
+			return false;
+		}
+	}
+
+	// the range the modality transform can produce for the first slice's stored values, shifted (and if need be
+	// scaled) into 0..65535; slices with other rescale parameters share it and get clamped
+	void chooseValueMapping(const Slice &slice)
+	{
+		int bits = std::min(std::max(slice.bitsStored, 1), 32);
+		double storedMin = slice.isSigned ? -std::ldexp(1.0, bits - 1) : 0.0;
+		double storedMax = slice.isSigned ? std::ldexp(1.0, bits - 1) - 1.0 : std::ldexp(1.0, bits) - 1.0;
+		double low = std::min(storedMin * slice.rescaleSlope, storedMax * slice.rescaleSlope) + slice.rescaleIntercept;
+		double high = std::max(storedMin * slice.rescaleSlope, storedMax * slice.rescaleSlope) + slice.rescaleIntercept;
+		valueOffset = std::floor(low);
+		valueScale = high - valueOffset <= 65535.0 ? 1.0 : 65535.0 / (high - valueOffset);
+	}
+
+	template <typename T>
+	void convertSlice(const char *data, size_t count, unsigned short *dst) const
+	{
+		const T *values = (const T *)data;
+		if (valueScale == 1.0) {
+			long long offset = (long long)valueOffset;
+			for (size_t i = 0; i < count; i++) {
+				long long value = (long long)values[i] - offset;
+				dst[i] = (unsigned short)std::min(std::max(value, 0LL), 65535LL);
+			}
+		}
+		else {
+			for (size_t i = 0; i < count; i++) {
+				double value = ((double)values[i] - valueOffset) * valueScale + 0.5;
+				dst[i] = (unsigned short)std::min(std::max(value, 0.0), 65535.0);
+			}
+		}
+	}
+
+	bool decodeSlice(const Slice &slice, unsigned short *dst) const
+	{
+		try {
+			imebra::DataSet dataSet(imebra::CodecFactory::load(slice.path));
+			imebra::Image image(dataSet.getImageApplyModalityTransform(0));
+			if ((int)image.getWidth() != slice.columns || (int)image.getHeight() != slice.rows || image.getChannelsNumber() != 1) {
+				return false;
+			}
+			imebra::ReadingDataHandlerNumeric pixels(image.getReadingDataHandler());
+			size_t dataSize = 0;
+			const char *data = pixels.data(&dataSize);
+			size_t count = (size_t)slice.columns * slice.rows;
+
+			switch (image.getDepth()) {
+			case imebra::bitDepth_t::depthU8: convertSlice<std::uint8_t>(data, std::min(count, dataSize), dst); break;
+			case imebra::bitDepth_t::depthS8: convertSlice<std::int8_t>(data, std::min(count, dataSize), dst); break;
+			case imebra::bitDepth_t::depthU16: convertSlice<std::uint16_t>(data, std::min(count, dataSize / 2), dst); break;
+			case imebra::bitDepth_t::depthS16: convertSlice<std::int16_t>(data, std::min(count, dataSize / 2), dst); break;
+			case imebra::bitDepth_t::depthU32: convertSlice<std::uint32_t>(data, std::min(count, dataSize / 4), dst); break;
+			case imebra::bitDepth_t::depthS32: convertSlice<std::int32_t>(data, std::min(count, dataSize / 4), dst); break;
+			default: return false;
+			}
+			return true;
+		}
+		catch (const std::exception &) {
+			return false;
+		}
+	}
+};
+
+#endif
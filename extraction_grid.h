@@ -0,0 +1,86 @@
+#pragma once
+#ifndef EXTRACTION_GRID
+#define EXTRACTION_GRID
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+
+// the cells an extraction runs over, along the axes of the volume texture (see genTexImage3D). cells are cubes in
+// physical space: outputShape of them span the longest side of the volume, and every axis gets only as many as its
+// extent needs, so an elongated or anisotropic volume dispatches no cells past the end of its shorter sides
+struct ExtractionGrid
+{
+	// ActiveGroups packs a workgroup into 10 bits per axis, so at most 1023 workgroups of 4 cells (the least a
+	// workgroup has along an axis) and the lattice
+	static const int maxCellsPerAxis = 1023 * 4 - 4;
+
+	// cells per axis
+	glm::ivec3 cellShape = glm::ivec3(0);
+	// voxels of level 0 per cell along each axis
+	glm::vec3 cubeRatio = glm::vec3(1.0f);
+	// mesh units per cell; the longest side of the volume is 10 long
+	float sizeCompressRatio = 1.0f;
+	// turns a gradient in voxels into one in physical space (1 / spacing, the largest component 1)
+	glm::vec3 gradientScale = glm::vec3(1.0f);
+	// level of the volume pyramid the cells sample
+	int pyramidLevel = 0;
+	// cells per extraction workgroup and axis, the local size ComputeShader.glsl was compiled with (see workgroup_tuner.h)
+	glm::ivec3 groupCells = glm::ivec3(4);
+
+	// texShape in voxels, texSpacing the distance between neighbouring voxels along the same axes
+	static ExtractionGrid make(glm::ivec3 texShape, glm::vec3 texSpacing, int outputShape)
+	{
+		ExtractionGrid grid;
+		glm::vec3 extent = glm::vec3(texShape) * texSpacing;
+		float cellSize = std::max({ extent.x, extent.y, extent.z }) / outputShape;
+		grid.cubeRatio = cellSize / texSpacing;
+		// the last lattice point has to stay short of the last voxel for its trilinear neighbour
+		for (int axis = 0; axis < 3; axis++) {
+			int cells = (int)std::ceil((texShape[axis] - 1) / grid.cubeRatio[axis] - 1e-4f);
+			grid.cellShape[axis] = std::min(std::max(cells, 1), (int)maxCellsPerAxis);
+		}
+		grid.sizeCompressRatio = 10.0f / outputShape;
+		float smallestSpacing = std::min({ texSpacing.x, texSpacing.y, texSpacing.z });
+		grid.gradientScale = smallestSpacing / texSpacing;
+		return grid;
+	}
+
+	// one lattice point more than cells per axis
+	glm::ivec3 latticeShape() const
+	{
+		return cellShape + 1;
+	}
+
+	// extraction workgroups of groupCells per axis, enough for the lattice
+	glm::ivec3 groupShape() const
+	{
+		return (cellShape + groupCells) / groupCells;
+	}
+
+	size_t cellCount() const
+	{
+		return (size_t)cellShape.x * cellShape.y * cellShape.z;
+	}
+
+	size_t latticeCount() const
+	{
+		glm::ivec3 lattice = latticeShape();
+		return (size_t)lattice.x * lattice.y * lattice.z;
+	}
+
+	// the coarsest level a sampler may read is the one whose voxels are no larger than the cell on any axis
+	float smallestCubeRatio() const
+	{
+		return std::min({ cubeRatio.x, cubeRatio.y, cubeRatio.z });
+	}
+
+	bool operator==(const ExtractionGrid &other) const
+	{
+		return cellShape == other.cellShape && cubeRatio == other.cubeRatio && pyramidLevel == other.pyramidLevel &&
+			groupCells == other.groupCells;
+	}
+};
+
+#endif
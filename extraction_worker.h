@@ -0,0 +1,125 @@
+#pragma once
+#ifndef EXTRACTION_WORKER
+#define EXTRACTION_WORKER
+
+#include "thread_pool.h"
+#include "cpu_marching_cubes.h"
+
+#include <glm/glm.hpp>
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <vector>
+
+// runs createMarchingCubesCPU on a thread of its own, so the render loop never waits for an extraction.
+// only the newest request matters: submitting cancels the one in flight and drops any result nobody took yet
+class ExtractionWorker
+{
+public:
+	struct Result
+	{
+		ExtractionGrid grid;
+		float isoLevel;
+		std::vector<glm::vec4> positions;
+		std::vector<glm::vec4> normals;
+	};
+
+	ExtractionWorker(ThreadPool &pool, const VolumePyramid &pyramid, int maxImgValue)
+		: pool(pool), pyramid(pyramid), maxImgValue(maxImgValue)
+	{
+		worker = std::thread(&ExtractionWorker::workerLoop, this);
+	}
+
+	~ExtractionWorker()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+			isCancelled = true;
+		}
+		requestReady.notify_one();
+		worker.join();
+	}
+
+	void submit(const ExtractionGrid &grid, float isoLevel)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			request.grid = grid;
+			request.isoLevel = isoLevel;
+			hasRequest = true;
+			hasResult = false;
+			isCancelled = true;
+		}
+		requestReady.notify_one();
+	}
+
+	// forget the request in flight and any result nobody took yet
+	void cancel()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		hasRequest = false;
+		hasResult = false;
+		isCancelled = true;
+	}
+
+	// true if a finished extraction was moved into result; never blocks on the extraction itself
+	bool takeResult(Result &result)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!hasResult) {
+			return false;
+		}
+		result = std::move(finished);
+		hasResult = false;
+		return true;
+	}
+
+private:
+	ThreadPool &pool;
+	const VolumePyramid &pyramid;
+	int maxImgValue;
+
+	std::thread worker;
+	std::mutex mutex;
+	std::condition_variable requestReady;
+	bool stopping = false;
+	bool hasRequest = false;
+	bool hasResult = false;
+	Result request;
+	Result finished;
+	// polled by createMarchingCubesCPU between slabs
+	std::atomic<bool> isCancelled{ false };
+
+	void workerLoop()
+	{
+		while (true) {
+			Result current;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				requestReady.wait(lock, [this] { return stopping || hasRequest; });
+				if (stopping) {
+					return;
+				}
+				current.grid = request.grid;
+				current.isoLevel = request.isoLevel;
+				hasRequest = false;
+				isCancelled = false;
+			}
+
+			createMarchingCubesCPU(pool, pyramid, current.grid, maxImgValue, current.isoLevel,
+				current.positions, current.normals, &isCancelled);
+
+			std::lock_guard<std::mutex> lock(mutex);
+			// cancelled means a newer request (or none at all) replaced this one
+			if (!isCancelled) {
+				finished = std::move(current);
+				hasResult = true;
+			}
+		}
+	}
+};
+
+#endif
@@ -1,131 +1,1507 @@
 #include <main.h>
 // SSBOs
-GLuint inImgSSBO, outPositionsSSBO, outNormalsSSBO, outTrianglesCountSSBO, edgeTableSSBO, triTableSSBO;
-GLuint image3DTexObj;
+GLuint outPositionsSSBO, outNormalsSSBO, outTrianglesCountSSBO, edgeTableSSBO, triTableSSBO, cellTrianglesSSBO, latticeVerticesSSBO, outIndicesSSBO, activeGroupsSSBO, activeDispatchSSBO, pageTableSSBO;
+GLuint image3DTexObj, gradientTexObj, brickMinMaxTexObj, brickCacheTexObj;
+int brickLevels;
 
 int imageX, imageY, imageZ;
+// distance between neighbouring voxels along x y z (as in file_config.txt); cells are cubes in this space
+glm::vec3 voxelSpacing(1.0f);
+// raw voxels stay mapped for the CPU engine
+RawVolume rawVolume;
+DicomSeries dicomSeries;
+BrickedVolume brickedVolume;
+const unsigned short *imgValsUINT;
+unsigned short maxImgValue = 0;
+// gathered while uploading the volume
+VolumeStatistics volumeStatistics;
+// iso levels suggested by the histogram, in the units of the iso level slider
+float otsuIsoLevel = 0.0f;
+std::vector<float> peakIsoLevels;
 
 // has to be there so as to clear SSBO buffers properly?
 int outTrianglesBuffer;
 
 // count the total number of triangles from all batches
+// (only known on the CPU where buffers are sized from it; drawMesh takes the count from drawCommandBuffer)
 glm::uint outTrianglesCount = 0;
+// 3 per triangle, unless the mesh is indexed
+glm::uint outVerticesCount = 0;
+
+// everything one extracted mesh is drawn from. the GPU path hands its output SSBOs over to the mesh,
+// the CPU engine uploads into a VBO of its own; drawCommand is the indirect command for drawMesh.
+// the vertex buffers go back to bufferPool when the mesh is released, the VAO and drawCommand stay with it
+struct MeshBuffers {
+	GLuint VAO = 0;
+	// positions, normals, indices (0 if not indexed)
+	GLuint vertexBuffers[3] = { 0, 0, 0 };
+	GLuint drawCommand = 0;
+	bool isIndexed = false;
+	// vertices the vertex buffers hold (normals in normalBuffer from normalOffset on) and indices the index buffer
+	// holds; how many of them are drawn is up to drawCommand
+	GLuint vertexCapacity = 0;
+	GLuint indexCapacity = 0;
+	GLuint normalBuffer = 0;
+	GLintptr normalOffset = 0;
+};
+
+// the render loop draws frontMesh, while backMesh is being built; backMesh replaces it once complete
+MeshBuffers frontMesh, backMesh;
+// signalled when the GPU has finished writing backMesh
+GLsync backMeshFence = 0;
+// the latest iso level / number of cubes that has not been handed to an extraction yet
+bool hasPendingRequest = false;
+int pendingOutputShape;
+float pendingIsoLevel;
+// what backMesh was extracted for, to redo it with room for its totals
+int backOutputShape;
+float backIsoLevel;
+ExtractionWorker *extractionWorker;
+
+// GPU to CPU copies, polled once per frame; nothing in the render loop waits for them
+ReadbackQueue readbackQueue;
+// triangles frontMesh draws as read back from its draw command, -1 while the copy is on the way
+long long frontMeshTriangles = -1;
+// where export writes the mesh (file_config.txt can say otherwise), and how the last export went
+std::string meshExportPath = "mesh.stl";
+std::string meshExportStatus;
 float *outPositions;
 float *outNormals;
 
 // if true, we have properly set edgetable and tritable for compute shader; no need to pass them to it again
 bool hasInitializdMarchingCubes = false;
 
-void genTexImage3D(unsigned short *imgVals, glm::ivec3 img3DShape) {
-	glGenTextures(1, &image3DTexObj);
+// extract on the CPU thread pool instead of dispatching ComputeShader.glsl
+bool useCpuEngine = false;
+
+// local size of ComputeShader.glsl in cells per axis; tuned once per GPU and driver (see tuneExtractionShader)
+// and kept in workgroupTuningPath
+glm::ivec3 extractionGroupCells = glm::ivec3(4);
+const char *workgroupTuningPath = "workgroup_tuning.txt";
+
+// workgroups per glDispatchCompute over the whole grid: a full resolution grid in one dispatch can run long enough
+// for the OS to reset the driver, so it goes out in slabs (see dispatchExtraction). a multiple of the 256 workgroups
+// a row of an indirect dispatch over ActiveGroups has
+const int maxGroupsPerDispatch = 1 << 16;
+// indirect dispatch commands in ActiveDispatch, one per chunk of maxGroupsPerDispatch workgroups of ActiveGroups
+int activeDispatchCount = 0;
+// GL_MAX_SHADER_STORAGE_BLOCK_SIZE, 0 until asked for (see getMaxStorageBlockBytes)
+GLint64 maxStorageBlockBytes = 0;
+// the last GPU extraction made more triangles or vertices than one storage block holds and was cut short
+bool isMeshTruncated = false;
+
+// count triangles per cell, prefix-sum the counts and then write into buffers of exactly the right size;
+// otherwise the shader appends through one atomic counter into worst-case sized buffers
+bool useExactSizeOutput = true;
+// without it: a workgroup adds up its triangles in shared memory and takes room for them with one atomicAdd,
+// instead of every triangle contending for the counter on its own
+bool useGroupAllocation = true;
+// GPU time of the last GPU extraction (GL_TIME_ELAPSED, see pollExtractionTime), -1 while it is not known
+GLuint extractionTimeQuery = 0;
+bool isExtractionTimePending = false;
+double extractionGpuMs = -1.0;
+
+// one vertex per crossed grid edge, shared by all triangles around it, plus an index buffer
+bool useIndexedMesh = true;
+
+// the exact size and indexed modes do not wait for their scanned totals: the output is sized from the totals of an
+// earlier extraction (see estimateOutputCapacity), and the totals come back behind the extraction (see
+// readOutputTotals). hasOutputOverflowed says the last extraction made more than it had room for and must be redone
+glm::uint lastTotalTriangles = 0;
+glm::uint lastTotalVertices = 0;
+size_t lastTotalsCellCount = 0;
+bool hasOutputOverflowed = false;
+
+// take normals from the precomputed gradient texture instead of 6 trilinear samples per vertex
+bool useGradientTexture = true;
+
+// only dispatch the workgroups whose voxels' [min, max] contains the iso level
+bool useEmptySpaceSkipping = true;
+
+// with empty space skipping, take the active workgroups from a CPU span space index over their voxel ranges
+// instead of culling all of them in BrickShader.glsl; the index is rebuilt when the extraction grid changes
+bool useSpanSpaceIndex = true;
+SpanSpaceIndex groupSpanIndex;
+ExtractionGrid groupSpanIndexGrid;
+
+// coarse grids sample the level of volumePyramid whose voxels are about the size of a cell,
+// instead of picking single voxels out of the full resolution volume cubeRatio voxels apart
+bool useVolumePyramid = true;
+VolumePyramid volumePyramid;
+
+// format of the volume texture and how the shaders decode its texels, see setVolumeTextureFormat;
+// the CPU engine and the span space index always work on the full precision voxels
+VolumeQuantizer volumeQuantizer;
+// of the current format, over the values in the histogram: largest iso level error, voxels clamped to the R8 window
+float volumeTextureError = 0.0f;
+uint64_t volumeTextureClampedVoxels = 0;
+
+// read the volume through brickCache instead of the volume texture. a volume larger than maxVolumeTextureBytes
+// (or than GL_MAX_3D_TEXTURE_SIZE) gets no volume texture, gradient texture or brick pyramid at all and always
+// does this. the active workgroups of the span space index decide which bricks are paged in, so the extraction
+// then always skips empty space through the index, and takes its normals from central differences
+bool useBrickCache = false;
+bool isVolumeTextureResident = true;
+const size_t maxVolumeTextureBytes = (size_t)2 << 30;
+size_t brickCacheBytes = (size_t)512 << 20;
+BrickCache brickCache;
+// mesh coordinates to clip space as last drawn, to page in the bricks in view first when not all of them fit
+glm::mat4 meshToClip;
+bool hasMeshToClip = false;
+// central difference normals reach 2.1 voxels of level 0 past a vertex, plus their trilinear neighbours
+const int normalApron = 3;
+
+// extract out of core: the grid goes through in slabs of workgroup layers, and each slab uploads only the layers of
+// the volume it reads (with a halo for the trilinear and normal samples) into a texture of its own, extracts with exact size
+// output and reads its triangles back into one growing mesh. the GPU then holds one slab of volume and of output
+// instead of the volume texture and worst case buffers; normals are central differences, as with the brick cache
+bool useSlabBatching = false;
+// the most bytes of volume a slab uploads
+size_t slabBatchBytes = (size_t)64 << 20;
+// of the last slab batched extraction
+int slabBatchCount = 0;
+int slabBatchLayers = 0;
+
+// texture layers per slab of genTexImage3D (a multiple of the statistics' brick size),
+// and the number of pixel unpack buffers it cycles through
+const int uploadSlabLayers = 16;
+const int uploadBufferCount = 3;
+
+// upload the volume into an R16 texture and fill volumeStatistics / maxImgValue on the way, one slab of texture layers
+// at a time: an I/O thread reads slabs ahead from disk, the thread pool copies a slab into the next free pixel unpack
+// buffer while accumulating its statistics, and the GPU pulls the earlier slabs out of their buffers meanwhile.
+// the coarser levels of volumePyramid are reduced from the same slabs and become the texture's mip levels.
+// without isVolumeTextureResident there is no texture; only the statistics and the pyramid are made
+void genTexImage3D(const unsigned short *imgVals, glm::ivec3 img3DShape) {
+	if (isVolumeTextureResident) {
+		glGenTextures(1, &image3DTexObj);
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_3D, image3DTexObj);
+		glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+		// only read through texelFetch; a mipmap filter keeps the pyramid levels valid for it
+		glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+		glTexImage3D(GL_TEXTURE_3D, 0, GL_R16, img3DShape.y, img3DShape.z, img3DShape.x, 0, GL_RED, GL_UNSIGNED_SHORT,
+			nullptr);
+	}
+
+	size_t layerVoxels = (size_t)img3DShape.y * img3DShape.z;
+	int layerCount = img3DShape.x;
+	int slabCount = (layerCount + uploadSlabLayers - 1) / uploadSlabLayers;
+
+	// slabs [0, slabsRead) are in memory
+	int slabsRead = 0;
+	std::mutex readMutex;
+	std::condition_variable slabRead;
+	std::thread reader([&]() {
+		for (int slab = 0; slab < slabCount; slab++) {
+			int firstLayer = slab * uploadSlabLayers;
+			int layers = std::min(uploadSlabLayers, layerCount - firstLayer);
+			prefetchPages(imgVals + layerVoxels * firstLayer, sizeof(unsigned short) * layerVoxels * layers);
+			std::lock_guard<std::mutex> lock(readMutex);
+			slabsRead = slab + 1;
+			slabRead.notify_one();
+		}
+	});
+
+	GLuint unpackBuffers[uploadBufferCount];
+	GLsync uploadFences[uploadBufferCount] = {};
+	glGenBuffers(uploadBufferCount, unpackBuffers);
+	for (int i = 0; i < uploadBufferCount; i++) {
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, unpackBuffers[i]);
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, sizeof(unsigned short) * layerVoxels * uploadSlabLayers, nullptr, GL_STREAM_DRAW);
+	}
+	// rows are 2 byte aligned whatever the width
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
+
+	volumeStatistics.begin(glm::ivec3(img3DShape.y, img3DShape.z, img3DShape.x));
+	volumePyramid.begin(imgVals, img3DShape);
+	for (int slab = 0; slab < slabCount; slab++) {
+		int firstLayer = slab * uploadSlabLayers;
+		int layers = std::min(uploadSlabLayers, layerCount - firstLayer);
+		{
+			std::unique_lock<std::mutex> lock(readMutex);
+			slabRead.wait(lock, [&] { return slabsRead > slab; });
+		}
+		if (!isVolumeTextureResident) {
+			volumeStatistics.accumulateSlab(*threadPool, imgVals + layerVoxels * firstLayer, nullptr, firstLayer, layers);
+			volumePyramid.reduceSlab(*threadPool, firstLayer, layers);
+			continue;
+		}
+
+		// wait until the GPU is done with the upload that used this buffer last
+		int bufferIndex = slab % uploadBufferCount;
+		if (uploadFences[bufferIndex] != 0) {
+			while (glClientWaitSync(uploadFences[bufferIndex], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED) {
+			}
+			glDeleteSync(uploadFences[bufferIndex]);
+			uploadFences[bufferIndex] = 0;
+		}
+
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, unpackBuffers[bufferIndex]);
+		unsigned short *slabVals = (unsigned short *)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, sizeof(unsigned short) * layerVoxels * layers,
+			GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+		if (slabVals == nullptr) {
+			// the buffer can not be mapped: upload this slab straight from the volume instead
+			printf("mapping an upload buffer failed, uploading layers %d to %d from client memory\n", firstLayer, firstLayer + layers - 1);
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+			volumeStatistics.accumulateSlab(*threadPool, imgVals + layerVoxels * firstLayer, nullptr, firstLayer, layers);
+			volumePyramid.reduceSlab(*threadPool, firstLayer, layers);
+			glTexSubImage3D(GL_TEXTURE_3D, 0, 0, 0, firstLayer, img3DShape.y, img3DShape.z, layers, GL_RED, GL_UNSIGNED_SHORT,
+				imgVals + layerVoxels * firstLayer);
+			continue;
+		}
+		volumeStatistics.accumulateSlab(*threadPool, imgVals + layerVoxels * firstLayer, slabVals, firstLayer, layers);
+		glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+		volumePyramid.reduceSlab(*threadPool, firstLayer, layers);
+
+		glTexSubImage3D(GL_TEXTURE_3D, 0, 0, 0, firstLayer, img3DShape.y, img3DShape.z, layers, GL_RED, GL_UNSIGNED_SHORT, (void*)0);
+		uploadFences[bufferIndex] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	}
+	reader.join();
+
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	volumePyramid.finish(*threadPool);
+	if (isVolumeTextureResident) {
+		for (int level = 1; level < volumePyramid.getLevelCount(); level++) {
+			glm::ivec3 levelShape = volumePyramid.getTexShape(level);
+			glTexImage3D(GL_TEXTURE_3D, level, GL_R16, levelShape.x, levelShape.y, levelShape.z, 0, GL_RED, GL_UNSIGNED_SHORT,
+				volumePyramid.getLevel(level));
+		}
+		glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAX_LEVEL, volumePyramid.getLevelCount() - 1);
+	}
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	for (int i = 0; i < uploadBufferCount; i++) {
+		if (uploadFences[i] != 0) {
+			glDeleteSync(uploadFences[i]);
+		}
+	}
+	// deleting is safe while uploads still read from them; GL keeps the storage until they are done
+	glDeleteBuffers(uploadBufferCount, unpackBuffers);
+
+	volumeStatistics.finish();
+	// everything that turns raw values into iso levels divides by it: an all-zero volume counts as reaching 1
+	maxImgValue = std::max<unsigned short>(volumeStatistics.maxValue, 1);
+	volumeQuantizer.configure(VolumeQuantizer::formatR16, maxImgValue, 0, 65535);
+}
+
+// whether a volume of img3DShape fits in one texture, with its pyramid levels
+bool fitsVolumeTexture(glm::ivec3 img3DShape) {
+	GLint maxTextureSide;
+	glGetIntegerv(GL_MAX_3D_TEXTURE_SIZE, &maxTextureSide);
+	size_t bytes = sizeof(unsigned short) * img3DShape.x * img3DShape.y * (size_t)img3DShape.z;
+	return std::max({ img3DShape.x, img3DShape.y, img3DShape.z }) <= maxTextureSide && bytes + bytes / 7 <= maxVolumeTextureBytes;
+}
+
+// GL format of volume and brick cache textures in the format of volumeQuantizer
+void getVolumeTextureFormat(GLenum &internalFormat, GLenum &type) {
+	internalFormat = GL_R16;
+	type = GL_UNSIGNED_SHORT;
+	if (volumeQuantizer.format == VolumeQuantizer::formatR8) {
+		internalFormat = GL_R8;
+		type = GL_UNSIGNED_BYTE;
+	}
+	else if (volumeQuantizer.format == VolumeQuantizer::formatR16F) {
+		internalFormat = GL_R16F;
+		type = GL_HALF_FLOAT;
+	}
+}
+
+// bind the volume texture to texture unit 0 for shader (in use), with the uniforms that decode its texels
+void bindVolumeTexture(Shader *shader) {
 	glActiveTexture(GL_TEXTURE0);
 	glBindTexture(GL_TEXTURE_3D, image3DTexObj);
+	shader->setInt("volumeTex", 0);
+	shader->setFloat("texelScale", volumeQuantizer.texelScale);
+	shader->setFloat("texelOffset", volumeQuantizer.texelOffset);
+}
+
+// bytes of all levels of the volume texture in its current format
+size_t volumeTextureBytes() {
+	size_t voxels = 0;
+	for (int level = 0; level < volumePyramid.getLevelCount(); level++) {
+		glm::ivec3 levelShape = volumePyramid.getTexShape(level);
+		voxels += (size_t)levelShape.x * levelShape.y * levelShape.z;
+	}
+	return voxels * volumeQuantizer.bytesPerVoxel();
+}
+
+// cache texture of brickCache (texture unit 3) in the format of volumeQuantizer, with as many slots as fit in
+// brickCacheBytes; the cache starts out empty
+void genBrickCache() {
+	size_t brickBytes = (size_t)BrickCache::brickSide * BrickCache::brickSide * BrickCache::brickSide * volumeQuantizer.bytesPerVoxel();
+	int slotCount = (int)std::max(brickCacheBytes / brickBytes, (size_t)1);
+	GLint maxTextureSide;
+	glGetIntegerv(GL_MAX_3D_TEXTURE_SIZE, &maxTextureSide);
+	int maxSlotsPerSide = maxTextureSide / BrickCache::brickSide;
+	int side = 1;
+	while ((side + 1) * (side + 1) * (side + 1) <= slotCount && side < maxSlotsPerSide) {
+		side++;
+	}
+	glm::ivec3 slotsShape(side, side, std::min(slotCount / (side * side), maxSlotsPerSide));
+	brickCache.reset(slotsShape);
+
+	GLenum internalFormat, type;
+	getVolumeTextureFormat(internalFormat, type);
+	glDeleteTextures(1, &brickCacheTexObj);
+	glGenTextures(1, &brickCacheTexObj);
+	glActiveTexture(GL_TEXTURE3);
+	glBindTexture(GL_TEXTURE_3D, brickCacheTexObj);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexStorage3D(GL_TEXTURE_3D, 1, internalFormat, slotsShape.x * BrickCache::brickSide, slotsShape.y * BrickCache::brickSide,
+		slotsShape.z * BrickCache::brickSide);
+	glActiveTexture(GL_TEXTURE0);
+}
+
+// iso level at which the surface separates raw values <= threshold from those above it
+float thresholdToIsoLevel(int threshold) {
+	// same normalization as getInputImgData in ComputeShader.glsl
+	return (threshold + 0.5f) / 65535.0f * 65536.0f / maxImgValue;
+}
+
+// normals for ComputeShader.glsl, computed once per volume by GradientShader.glsl;
+// stores unit vectors only, so RGBA8_SNORM is enough and costs 4 bytes per voxel
+void genGradientTexture(glm::ivec3 img3DShape) {
+	glDeleteTextures(1, &gradientTexObj);
+	glGenTextures(1, &gradientTexObj);
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_3D, gradientTexObj);
 	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
 	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
 	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexImage3D(GL_TEXTURE_3D, 0, GL_R16, img3DShape.y, img3DShape.z, img3DShape.x, 0, GL_RED, GL_UNSIGNED_SHORT,
-		imgVals);
+	glTexStorage3D(GL_TEXTURE_3D, 1, GL_RGBA8_SNORM, img3DShape.y, img3DShape.z, img3DShape.x);
+	glActiveTexture(GL_TEXTURE0);
+
+	gradientShader->use();
+	bindVolumeTexture(gradientShader);
+	glBindImageTexture(2, gradientTexObj, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_RGBA8_SNORM);
+	glDispatchCompute((img3DShape.y + 3) / 4, (img3DShape.z + 3) / 4, (img3DShape.x + 3) / 4);
+	glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
 }
 
-void createMarchingCubes(const int outputShape, const float isoLevel, const glm::ivec3 inShape, unsigned int &VAO, unsigned int &VBO) {
+// min/max of every 8x8x8 voxel brick, and of 2x2x2 groups of bricks on every further mip level, built once per
+// volume by BrickShader.glsl; level 0 is rounded up to powers of two so every level halves exactly
+void genBrickPyramid(glm::ivec3 img3DShape) {
+	int brickShape[3] = { 1, 1, 1 };
+	int texShape[3] = { img3DShape.y, img3DShape.z, img3DShape.x };
+	for (int axis = 0; axis < 3; axis++) {
+		while (brickShape[axis] * 8 < texShape[axis]) {
+			brickShape[axis] *= 2;
+		}
+	}
+	brickLevels = 1;
+	while ((std::max({ brickShape[0], brickShape[1], brickShape[2] }) >> (brickLevels - 1)) > 1) {
+		brickLevels++;
+	}
 
-	int inMaxDim = std::max({ inShape.x, inShape.y, inShape.z }); // in 3 dimensions of input image3D, which dimension has the largest index?
-	float cubeRatio = inMaxDim * 1.0f / outputShape;
+	glDeleteTextures(1, &brickMinMaxTexObj);
+	glGenTextures(1, &brickMinMaxTexObj);
+	glActiveTexture(GL_TEXTURE2);
+	glBindTexture(GL_TEXTURE_3D, brickMinMaxTexObj);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+	glTexStorage3D(GL_TEXTURE_3D, brickLevels, GL_RG16UI, brickShape[0], brickShape[1], brickShape[2]);
+	glActiveTexture(GL_TEXTURE0);
 
-	outTrianglesCount = 0;
+	brickShader->use();
+	bindVolumeTexture(brickShader);
+	brickShader->setFloat("isoPerRaw", 65536.0f / 65535.0f / maxImgValue);
+	for (int level = 0; level < brickLevels; level++) {
+		brickShader->setInt("brickPass", level == 0 ? 0 : 1);
+		glBindImageTexture(3, brickMinMaxTexObj, level, GL_TRUE, 0, GL_WRITE_ONLY, GL_RG16UI);
+		if (level > 0) {
+			glBindImageTexture(4, brickMinMaxTexObj, level - 1, GL_TRUE, 0, GL_READ_ONLY, GL_RG16UI);
+		}
+		glDispatchCompute((std::max(brickShape[0] >> level, 1) + 3) / 4, (std::max(brickShape[1] >> level, 1) + 3) / 4, (std::max(brickShape[2] >> level, 1) + 3) / 4);
+		glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_TEXTURE_FETCH_BARRIER_BIT);
+	}
+}
 
-	// TODO how large?
-	int preservedPosMemorySize = sizeof(glm::vec4) * outputShape * outputShape * outputShape * 2;
-	int preservedNormalMemorySize = sizeof(glm::vec4) * outputShape * outputShape * outputShape * 2;
+// re-specify every level of the volume texture as R16, R8 or R16F (VolumeQuantizer::formatR16 and so on), where R8
+// quantizes the iso levels [windowLowIso, windowHighIso] and clamps the rest. the levels are converted on the thread
+// pool one slab at a time; the gradient texture and the brick pyramid are then built again from the new texels
+void setVolumeTextureFormat(int format, float windowLowIso, float windowHighIso, glm::ivec3 img3DShape) {
+	// at least one raw step between the ends of the window
+	float rawPerIso = std::max<unsigned short>(maxImgValue, 1) * 65535.0f / 65536.0f;
+	int windowLow = (int)std::floor(windowLowIso * rawPerIso);
+	int windowHigh = std::max((int)std::ceil(windowHighIso * rawPerIso), windowLow + 1);
+	volumeQuantizer.configure(format, maxImgValue, windowLow, windowHigh);
+	volumeQuantizer.measureError(volumeStatistics.histogram, volumeTextureError, volumeTextureClampedVoxels);
+	// the cache is filled again in the new format as the extraction asks for bricks
+	if (brickCacheTexObj != 0) {
+		genBrickCache();
+	}
+	if (!isVolumeTextureResident) {
+		return;
+	}
+	GLenum internalFormat, type;
+	getVolumeTextureFormat(internalFormat, type);
 
-	computeShader->use();
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_3D, image3DTexObj);
+	// R8 rows can have any length
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	std::vector<unsigned char> slab;
+	for (int level = 0; level < volumePyramid.getLevelCount(); level++) {
+		glm::ivec3 levelShape = volumePyramid.getTexShape(level);
+		const unsigned short *levelVals = volumePyramid.getLevel(level);
+		size_t layerVoxels = (size_t)levelShape.x * levelShape.y;
+		size_t layerBytes = layerVoxels * volumeQuantizer.bytesPerVoxel();
+		glTexImage3D(GL_TEXTURE_3D, level, internalFormat, levelShape.x, levelShape.y, levelShape.z, 0, GL_RED, type, nullptr);
+		slab.resize(layerBytes * std::min(uploadSlabLayers, levelShape.z));
+		for (int firstLayer = 0; firstLayer < levelShape.z; firstLayer += uploadSlabLayers) {
+			int layers = std::min(uploadSlabLayers, levelShape.z - firstLayer);
+			threadPool->parallelFor(0, layers, [&](int layer) {
+				volumeQuantizer.convert(levelVals + layerVoxels * (firstLayer + layer), slab.data() + layerBytes * layer, layerVoxels);
+			});
+			// copied out of slab before this returns
+			glTexSubImage3D(GL_TEXTURE_3D, level, 0, 0, firstLayer, levelShape.x, levelShape.y, layers, GL_RED, type, slab.data());
+		}
+	}
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+	genGradientTexture(img3DShape);
+	genBrickPyramid(img3DShape);
+}
+
+// list the extraction workgroups of grid whose voxels can contain isoLevel in ActiveGroups,
+// together with the indirect dispatch command over them
+void cullWorkgroups(const ExtractionGrid &grid, float isoLevel) {
+	glm::ivec3 groupShape = grid.groupShape();
+	int groupCount = groupShape.x * groupShape.y * groupShape.z;
+	// no active workgroups yet; as many dispatch commands as if all of them were
+	GLuint noActiveGroups = 0;
+	createSSBO(activeGroupsSSBO, (1 + groupCount) * sizeof(GLuint), 13, nullptr, brickShader);
+	glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(noActiveGroups), &noActiveGroups);
+	activeDispatchCount = (groupCount + maxGroupsPerDispatch - 1) / maxGroupsPerDispatch;
+	createSSBO(activeDispatchSSBO, 3 * activeDispatchCount * sizeof(GLuint), 17, nullptr, brickShader);
+
+	glActiveTexture(GL_TEXTURE2);
+	glBindTexture(GL_TEXTURE_3D, brickMinMaxTexObj);
+	bindVolumeTexture(brickShader);
+
+	brickShader->setInt("brickMinMax", 2);
+	brickShader->setInt("brickLevels", brickLevels);
+	brickShader->setFloat("isoPerRaw", 65536.0f / 65535.0f / maxImgValue);
+	brickShader->setVec3("cubeRatio", grid.cubeRatio);
+	brickShader->setInt("pyramidLevel", grid.pyramidLevel);
+	brickShader->setFloat("isoLevel", isoLevel);
+	brickShader->setIVec3("groupShape", groupShape.x, groupShape.y, groupShape.z);
+	brickShader->setIVec3("groupCells", grid.groupCells.x, grid.groupCells.y, grid.groupCells.z);
+	brickShader->setUInt("groupsPerDispatch", maxGroupsPerDispatch);
+	brickShader->setInt("dispatchCount", activeDispatchCount);
+
+	brickShader->setInt("brickPass", 2);
+	glDispatchCompute((groupShape.x + 3) / 4, (groupShape.y + 3) / 4, (groupShape.z + 3) / 4);
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+	brickShader->setInt("brickPass", 3);
+	glDispatchCompute(1, 1, 1);
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT);
+}
+
+// the workgroups groupSpanIndex finds for isoLevel, packed as in ActiveGroups
+void queryActiveGroups(const ExtractionGrid &grid, float isoLevel, glm::ivec3 inShape, std::vector<GLuint> &activeGroups) {
+	if (!(groupSpanIndexGrid == grid)) {
+		groupSpanIndex.build(*threadPool, imgValsUINT, inShape, maxImgValue, grid.groupShape(), grid.groupCells, grid.cubeRatio,
+			grid.pyramidLevel);
+		groupSpanIndexGrid = grid;
+	}
+
+	if (volumeQuantizer.format == VolumeQuantizer::formatR16) {
+		groupSpanIndex.query(isoLevel, activeGroups);
+	}
+	else {
+		// the shaders see the quantized values: ask for the raw ranges that read as containing isoLevel,
+		// with the same quarter of a raw unit as query(isoLevel)
+		int highestMin, lowestMax;
+		volumeQuantizer.rawBounds(isoLevel, 0.25f * 65536.0f / 65535.0f / maxImgValue, highestMin, lowestMax);
+		groupSpanIndex.query(highestMin, lowestMax, activeGroups);
+	}
+}
+
+// page in the bricks of pyramidLevel that the listed workgroups read, upload the level's page table and drop the
+// workgroups that still miss a brick; if not all bricks fit in the cache, the ones in view go first
+void makeBricksResident(std::vector<GLuint> &activeGroups, const ExtractionGrid &extractionGrid, glm::ivec3 inShape) {
+	if (brickCacheTexObj == 0) {
+		genBrickCache();
+	}
+	int pyramidLevel = extractionGrid.pyramidLevel;
+	glm::ivec3 levelTexShape = volumePyramid.getTexShape(pyramidLevel);
+	glm::ivec3 grid = BrickCache::gridShape(levelTexShape);
+
+	// bricks of every workgroup, as lowest and highest brick per axis
+	std::vector<glm::ivec3> brickLows(activeGroups.size()), brickHighs(activeGroups.size());
+	for (size_t i = 0; i < activeGroups.size(); i++) {
+		GLuint packed = activeGroups[i];
+		glm::ivec3 group(packed & 1023, (packed >> 10) & 1023, packed >> 20);
+		for (int axis = 0; axis < 3; axis++) {
+			int low, high;
+			SpanSpaceIndex::groupLevelRange(group[axis], extractionGrid.groupCells[axis], extractionGrid.cubeRatio[axis], pyramidLevel,
+				levelTexShape[axis], normalApron, low, high);
+			brickLows[i][axis] = low / BrickCache::brickSide;
+			brickHighs[i][axis] = high / BrickCache::brickSide;
+		}
+	}
+
+	// if not all bricks fit, whole workgroups should: a brick ranks with the first workgroup that reads it, and the
+	// workgroups in view go first, nearest first. group centers go to mesh coordinates like the extracted vertices
+	std::vector<float> groupPriority(activeGroups.size(), 0.0f);
+	if (hasMeshToClip) {
+		float meshPerCell = extractionGrid.sizeCompressRatio;
+		for (size_t i = 0; i < activeGroups.size(); i++) {
+			GLuint packed = activeGroups[i];
+			glm::vec3 center = (glm::vec3(packed & 1023, (packed >> 10) & 1023, packed >> 20) + 0.5f) * glm::vec3(extractionGrid.groupCells);
+			glm::vec4 clip = meshToClip * glm::vec4(center * meshPerCell, 1.0f);
+			bool isInView = clip.w > 0.0f && std::abs(clip.x) <= clip.w && std::abs(clip.y) <= clip.w;
+			groupPriority[i] = (isInView ? 0.0f : 1e6f) + clip.w;
+		}
+	}
+	std::vector<int> groupOrder(activeGroups.size());
+	for (int i = 0; i < (int)groupOrder.size(); i++) {
+		groupOrder[i] = i;
+	}
+	std::stable_sort(groupOrder.begin(), groupOrder.end(), [&](int a, int b) { return groupPriority[a] < groupPriority[b]; });
+
+	std::vector<char> requested((size_t)grid.x * grid.y * grid.z, 0);
+	std::vector<float> priority(requested.size(), 0.0f);
+	for (int rank = 0; rank < (int)groupOrder.size(); rank++) {
+		int i = groupOrder[rank];
+		for (int z = brickLows[i].z; z <= brickHighs[i].z; z++) {
+			for (int y = brickLows[i].y; y <= brickHighs[i].y; y++) {
+				for (int x = brickLows[i].x; x <= brickHighs[i].x; x++) {
+					size_t brick = x + (size_t)grid.x * (y + (size_t)grid.y * z);
+					if (!requested[brick]) {
+						requested[brick] = 1;
+						priority[brick] = (float)rank;
+					}
+				}
+			}
+		}
+	}
+
+	std::vector<BrickCache::Upload> uploads;
+	brickCache.update(pyramidLevel, grid, requested, priority, uploads);
+
+	// converted on the thread pool a batch at a time, then copied into their slots
+	GLenum internalFormat, type;
+	getVolumeTextureFormat(internalFormat, type);
+	const int batchBricks = 64;
+	size_t brickBytes = (size_t)BrickCache::brickSide * BrickCache::brickSide * BrickCache::brickSide * volumeQuantizer.bytesPerVoxel();
+	std::vector<unsigned char> batch(brickBytes * std::min(uploads.size(), (size_t)batchBricks));
+	const unsigned short *levelVals = volumePyramid.getLevel(pyramidLevel);
+	glActiveTexture(GL_TEXTURE3);
+	glBindTexture(GL_TEXTURE_3D, brickCacheTexObj);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	for (size_t first = 0; first < uploads.size(); first += batchBricks) {
+		int count = (int)std::min(uploads.size() - first, (size_t)batchBricks);
+		threadPool->parallelFor(0, count, [&](int i) {
+			BrickCache::copyBrick(levelVals, levelTexShape, uploads[first + i].brick, volumeQuantizer, batch.data() + brickBytes * i);
+		});
+		for (int i = 0; i < count; i++) {
+			glm::ivec3 origin = brickCache.slotOrigin(uploads[first + i].slot);
+			glTexSubImage3D(GL_TEXTURE_3D, 0, origin.x, origin.y, origin.z, BrickCache::brickSide, BrickCache::brickSide, BrickCache::brickSide,
+				GL_RED, type, batch.data() + brickBytes * i);
+		}
+	}
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	glActiveTexture(GL_TEXTURE0);
+
+	std::vector<GLuint> pageTable;
+	brickCache.pageTable(pyramidLevel, grid, pageTable);
+	createSSBO(pageTableSSBO, (GLsizeiptr)(pageTable.size() * sizeof(GLuint)), 16, pageTable.data(), computeShader);
+
+	if (brickCache.getMissingCount() == 0) {
+		return;
+	}
+	// the cache is too small for this surface: leave out the workgroups that would read bricks it could not take.
+	// an indexed mesh also takes the vertices on the far faces of a workgroup's cells from the lattice points of the
+	// workgroups after it (+x, +y, +z and the diagonals between them), so it has to go when one of those goes.
+	// those come later in the packed order, so going through the groups backwards settles them before it
+	glm::ivec3 groupShape = extractionGrid.groupShape();
+	std::vector<char> groupState((size_t)groupShape.x * groupShape.y * groupShape.z, 0);
+	std::vector<size_t> order(activeGroups.size());
+	for (size_t i = 0; i < activeGroups.size(); i++) {
+		GLuint packed = activeGroups[i];
+		order[i] = (packed & 1023) + (size_t)groupShape.x * (((packed >> 10) & 1023) + (size_t)groupShape.y * (packed >> 20));
+		// active, not decided yet
+		groupState[order[i]] = 1;
+	}
+	std::vector<size_t> byGroup(activeGroups.size());
+	for (size_t i = 0; i < byGroup.size(); i++) {
+		byGroup[i] = i;
+	}
+	std::sort(byGroup.begin(), byGroup.end(), [&](size_t a, size_t b) { return order[a] > order[b]; });
+
+	const char isKept = 2, isDropped = 3;
+	for (size_t i : byGroup) {
+		bool isResident = true;
+		for (int z = brickLows[i].z; z <= brickHighs[i].z && isResident; z++) {
+			for (int y = brickLows[i].y; y <= brickHighs[i].y && isResident; y++) {
+				for (int x = brickLows[i].x; x <= brickHighs[i].x && isResident; x++) {
+					isResident = pageTable[x + (size_t)grid.x * (y + (size_t)grid.y * z)] != 0;
+				}
+			}
+		}
+		GLuint packed = activeGroups[i];
+		glm::ivec3 group(packed & 1023, (packed >> 10) & 1023, packed >> 20);
+		for (int neighbour = 1; neighbour < 8 && isResident && useIndexedMesh; neighbour++) {
+			glm::ivec3 next = group + glm::ivec3(neighbour & 1, (neighbour >> 1) & 1, neighbour >> 2);
+			if (next.x < groupShape.x && next.y < groupShape.y && next.z < groupShape.z) {
+				isResident = groupState[next.x + (size_t)groupShape.x * (next.y + (size_t)groupShape.y * next.z)] != isDropped;
+			}
+		}
+		groupState[order[i]] = isResident ? isKept : isDropped;
+	}
+	size_t kept = 0;
+	for (size_t i = 0; i < activeGroups.size(); i++) {
+		if (groupState[order[i]] == isKept) {
+			activeGroups[kept++] = activeGroups[i];
+		}
+	}
+	activeGroups.resize(kept);
+}
+
+// upload the workgroups of queryActiveGroups as ActiveGroups, leaving it as cullWorkgroups would
+void uploadActiveGroups(const std::vector<GLuint> &activeGroups) {
+	// count, then the list; and the dispatch commands as brickPass 3 in BrickShader.glsl writes them
+	GLuint activeCount = (GLuint)activeGroups.size();
+	std::vector<GLuint> groupList = { activeCount };
+	groupList.insert(groupList.end(), activeGroups.begin(), activeGroups.end());
+	createSSBO(activeGroupsSSBO, (GLsizeiptr)(groupList.size() * sizeof(GLuint)), 13, groupList.data(), computeShader);
+
+	activeDispatchCount = (int)((activeCount + maxGroupsPerDispatch - 1) / maxGroupsPerDispatch);
+	std::vector<GLuint> commands;
+	for (int chunk = 0; chunk < activeDispatchCount; chunk++) {
+		GLuint chunkCount = std::min(activeCount - chunk * (GLuint)maxGroupsPerDispatch, (GLuint)maxGroupsPerDispatch);
+		GLuint rowLength = std::min(chunkCount, 256u);
+		commands.insert(commands.end(), { rowLength, (chunkCount + rowLength - 1) / rowLength, 1 });
+	}
+	createSSBO(activeDispatchSSBO, (GLsizeiptr)(commands.size() * sizeof(GLuint)), 17, commands.data(), computeShader);
+}
+
+// run ComputeShader.glsl over groupShape workgroups from workgroup layer firstLayer on, or only over the ones in
+// ActiveGroups, either way in dispatches of at most maxGroupsPerDispatch
+void dispatchExtraction(glm::ivec3 groupShape, int firstLayer = 0) {
+	if (useEmptySpaceSkipping || useBrickCache) {
+		computeShader->setIVec3("groupOffset", 0, 0, 0);
+		glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, activeDispatchSSBO);
+		for (int chunk = 0; chunk < activeDispatchCount; chunk++) {
+			computeShader->setUInt("activeGroupOffset", (GLuint)chunk * maxGroupsPerDispatch);
+			glDispatchComputeIndirect((GLintptr)(3 * chunk * sizeof(GLuint)));
+		}
+	}
+	else {
+		// at least one layer of workgroups; ExtractionGrid::maxCellsPerAxis keeps its sides far below the GL limit
+		int slabLayers = std::max(maxGroupsPerDispatch / (groupShape.x * groupShape.y), 1);
+		for (int z = 0; z < groupShape.z; z += slabLayers) {
+			computeShader->setIVec3("groupOffset", 0, 0, firstLayer + z);
+			glDispatchCompute(groupShape.x, groupShape.y, std::min(slabLayers, groupShape.z - z));
+		}
+	}
+}
+
+GLint64 getMaxStorageBlockBytes() {
+	if (maxStorageBlockBytes == 0) {
+		glGetInteger64v(GL_MAX_SHADER_STORAGE_BLOCK_SIZE, &maxStorageBlockBytes);
+	}
+	return maxStorageBlockBytes;
+}
+
+// the most cubes along the longest side the extraction can take: its per cell and per lattice point counts have to
+// fit in one storage block and be addressed by 32 bit indices
+int maxOutputShape(const glm::ivec3 inShape) {
+	GLint64 maxCounts = std::min(getMaxStorageBlockBytes() / (GLint64)sizeof(GLuint), (GLint64)UINT32_MAX) - 1;
+	int low = 16, high = ExtractionGrid::maxCellsPerAxis;
+	while (low < high) {
+		int middle = (low + high + 1) / 2;
+		ExtractionGrid grid = ExtractionGrid::make(glm::ivec3(inShape.y, inShape.z, inShape.x),
+			glm::vec3(voxelSpacing.y, voxelSpacing.z, voxelSpacing.x), middle);
+		if ((GLint64)grid.latticeCount() <= maxCounts) low = middle; else high = middle - 1;
+	}
+	return low;
+}
+
+// VAO and draw command of mesh: vec4 positions and vec4 normals (w unused) starting at the given byte offsets,
+// and 3 indices per triangle in mesh.vertexBuffers[2] if that is set
+void createMeshVAO(MeshBuffers &mesh, GLuint positionBuffer, GLintptr positionOffset, GLuint normalBuffer, GLintptr normalOffset) {
+	if (mesh.VAO == 0) {
+		glGenVertexArrays(1, &mesh.VAO);
+		glGenBuffers(1, &mesh.drawCommand);
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, mesh.drawCommand);
+		glBufferData(GL_DRAW_INDIRECT_BUFFER, 5 * sizeof(GLuint), nullptr, GL_DYNAMIC_DRAW);
+	}
+	glBindVertexArray(mesh.VAO);
+
+	// position attribute
+	glBindBuffer(GL_ARRAY_BUFFER, positionBuffer);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void*)positionOffset);
+	glEnableVertexAttribArray(0);
+	// normal attribute
+	glBindBuffer(GL_ARRAY_BUFFER, normalBuffer);
+	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void*)normalOffset);
+	glEnableVertexAttribArray(1);
+
+	mesh.normalBuffer = normalBuffer;
+	mesh.normalOffset = normalOffset;
+	// the element buffer binding is part of the VAO state
+	mesh.isIndexed = mesh.vertexBuffers[2] != 0;
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.vertexBuffers[2]);
+	glBindVertexArray(0);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, mesh.drawCommand);
+}
+
+// upload vertexCount vertices (vec4 position and vec4 normal each) from the CPU into mesh, drawn as a triangle soup
+void createMeshBuffers(const void *positions, const void *normals, GLuint vertexCount, MeshBuffers &mesh) {
+	GLsizeiptr totalPositionSize = sizeof(glm::vec4) * (GLsizeiptr)vertexCount;
+	GLsizeiptr totalNormalSize = sizeof(glm::vec4) * (GLsizeiptr)vertexCount;
+
+	// total size of the buffer in bytes
+	mesh.vertexBuffers[0] = bufferPool.acquire(totalPositionSize + totalNormalSize);
+	glBindBuffer(GL_ARRAY_BUFFER, mesh.vertexBuffers[0]);
+
+	glBufferSubData(GL_ARRAY_BUFFER, 0, totalPositionSize, positions);
+	glBufferSubData(GL_ARRAY_BUFFER, totalPositionSize, totalNormalSize, normals);
+
+	// positions and normals share the one buffer
+	createMeshVAO(mesh, mesh.vertexBuffers[0], 0, mesh.vertexBuffers[0], totalPositionSize);
+	mesh.vertexCapacity = vertexCount;
+	mesh.indexCapacity = 0;
+
+	GLuint drawCommand[5] = { vertexCount, 1, 0, 0, 0 };
+	glBufferSubData(GL_DRAW_INDIRECT_BUFFER, 0, sizeof(drawCommand), drawCommand);
+}
+
+// give the vertex buffers of mesh back to bufferPool; it draws nothing until it is extracted into again
+void releaseMesh(MeshBuffers &mesh) {
+	for (GLuint &buffer : mesh.vertexBuffers) {
+		bufferPool.release(buffer);
+		buffer = 0;
+	}
+}
+
+// release mesh and delete what stays with it
+void deleteMesh(MeshBuffers &mesh) {
+	releaseMesh(mesh);
+	glDeleteVertexArrays(1, &mesh.VAO);
+	glDeleteBuffers(1, &mesh.drawCommand);
+	mesh = MeshBuffers();
+}
+
+// make mesh.drawCommand draw 3 vertices per triangle, where the number of triangles is countBuffer[countIndex],
+// but no more than maxTriangles
+void writeDrawCommand(GLuint countBuffer, GLuint countIndex, GLuint maxTriangles, MeshBuffers &mesh) {
+	drawCommandShader->use();
+	drawCommandShader->setUInt("countIndex", countIndex);
+	drawCommandShader->setUInt("maxTriangles", maxTriangles);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 14, countBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 15, mesh.drawCommand);
+	glDispatchCompute(1, 1, 1);
+	glMemoryBarrier(GL_COMMAND_BARRIER_BIT);
+}
+
+void drawMesh(const MeshBuffers &mesh) {
+	if (mesh.vertexBuffers[0] == 0) {
+		return;
+	}
+	glBindVertexArray(mesh.VAO);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, mesh.drawCommand);
+	if (mesh.isIndexed) {
+		glDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, (void*)0);
+	}
+	else {
+		glDrawArraysIndirect(GL_TRIANGLES, (void*)0);
+	}
+}
+
+// read the number of triangles mesh draws back from its draw command into frontMeshTriangles
+void readMeshTriangles(const MeshBuffers &mesh) {
+	frontMeshTriangles = -1;
+	if (mesh.vertexBuffers[0] == 0) {
+		return;
+	}
+	readbackQueue.request({ { mesh.drawCommand, 0, sizeof(GLuint) } }, [](const std::vector<const unsigned char *> &parts) {
+		// vertices, or indices for an indexed mesh
+		frontMeshTriangles = *(const GLuint *)parts[0] / 3;
+	});
+}
+
+// write mesh to meshExportPath as binary STL once its buffers have been copied back, a few frames from now
+void exportMesh(const MeshBuffers &mesh) {
+	if (mesh.vertexBuffers[0] == 0) {
+		return;
+	}
+	std::vector<ReadbackQueue::Range> ranges = {
+		{ mesh.drawCommand, 0, sizeof(GLuint) },
+		{ mesh.vertexBuffers[0], 0, (GLsizeiptr)(sizeof(glm::vec4) * mesh.vertexCapacity) },
+		{ mesh.normalBuffer, mesh.normalOffset, (GLsizeiptr)(sizeof(glm::vec4) * mesh.vertexCapacity) },
+	};
+	if (mesh.isIndexed) {
+		ranges.push_back({ mesh.vertexBuffers[2], 0, (GLsizeiptr)(sizeof(GLuint) * mesh.indexCapacity) });
+	}
+	bool isIndexed = mesh.isIndexed;
+	size_t vertexCount = mesh.vertexCapacity;
+	meshExportStatus = "exporting to " + meshExportPath;
+	readbackQueue.request(ranges, [=](const std::vector<const unsigned char *> &parts) {
+		size_t triangleCount = *(const GLuint *)parts[0] / 3;
+		const uint32_t *indices = isIndexed ? (const uint32_t *)parts[3] : nullptr;
+		if (writeBinaryStl(meshExportPath, (const glm::vec4 *)parts[1], (const glm::vec4 *)parts[2], indices, triangleCount, vertexCount)) {
+			meshExportStatus = std::to_string(triangleCount) + " triangles written to " + meshExportPath;
+		}
+		else {
+			meshExportStatus = "can not write " + meshExportPath;
+		}
+	});
+}
+
+// groupCount workgroups of a 1D kernel, in rows of at most 65535 (the smallest dispatch limit GL allows per axis)
+void dispatchRows(GLuint groupCount) {
+	GLuint rowLength = std::min(groupCount, 65535u);
+	glDispatchCompute(rowLength, rowLength == 0 ? 0 : (groupCount + rowLength - 1) / rowLength, 1);
+}
+
+// exclusive prefix sum of the first valueCount uints of buffer, in place, with ScanShader.glsl
+void scanBuffer(GLuint buffer, GLuint valueCount) {
+	const GLuint scanBlockSize = 1024;
+	GLuint blockCount = (valueCount + scanBlockSize - 1) / scanBlockSize;
+
+	GLuint blockSumsBuffer = bufferPool.acquire((GLsizeiptr)blockCount * sizeof(GLuint));
+
+	scanShader->use();
+	scanShader->setUInt("valueCount", valueCount);
+	scanShader->setInt("scanStage", 0);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 8, buffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 9, blockSumsBuffer);
+	dispatchRows(blockCount);
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
 
-	// release buffer if marching cubes have already been created once
-	glDeleteVertexArrays(1, &VAO);
-	glDeleteBuffers(1, &VBO);
+	// a single block is already fully scanned; otherwise scan the block totals and add them back
+	if (blockCount > 1) {
+		scanBuffer(blockSumsBuffer, blockCount);
+
+		scanShader->use();
+		scanShader->setUInt("valueCount", valueCount);
+		scanShader->setInt("scanStage", 1);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 8, buffer);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 9, blockSumsBuffer);
+		dispatchRows(blockCount);
+		glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+	}
+
+	bufferPool.release(blockSumsBuffer);
+}
+
+// count pass and scan shared by the exact size and indexed modes over groupShape workgroups from workgroup layer
+// firstLayer on: afterwards CellTriangles holds where each of their cellCount cells (from cellLayerOffset on, see
+// ComputeShader.glsl) starts its triangles, with the total number of triangles in entry cellCount
+void countCellTriangles(GLuint cellCount, glm::ivec3 groupShape, int firstLayer) {
+
+	// one count per cell plus a trailing zero, so that after the exclusive scan the last entry is the total
+	GLsizeiptr countBytes = ((GLsizeiptr)cellCount + 1) * sizeof(GLuint);
+	createSSBO(cellTrianglesSSBO, countBytes, 5, nullptr, computeShader);
+	glClearBufferSubData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, 0, countBytes, GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+
+	computeShader->setInt("passMode", 1);
+	dispatchExtraction(groupShape, firstLayer);
 	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
 
+	scanBuffer(cellTrianglesSSBO, cellCount + 1);
+}
+
+// room for the triangles (or vertices) of an extraction over cellCount cells, at most limit: lastTotal from the
+// last extraction, over lastTotalsCellCount cells, grown with the surface (cells per side squared) and by a quarter
+GLuint estimateOutputCapacity(glm::uint lastTotal, size_t cellCount, GLuint limit) {
+	double surfaceRatio = 1.0;
+	if (lastTotalsCellCount > 0) {
+		surfaceRatio = std::pow((double)cellCount / (double)lastTotalsCellCount, 2.0 / 3.0);
+	}
+	else {
+		// nothing extracted yet: a few per cell on a surface through the middle of the grid
+		lastTotal = (glm::uint)std::min(8.0 * std::pow((double)cellCount, 2.0 / 3.0), (double)UINT32_MAX);
+	}
+	double capacity = lastTotal * surfaceRatio * 1.25 + 1024.0;
+	return (GLuint)std::min(capacity, (double)limit);
+}
+
+// copy the scanned totals of the extraction just queued back behind it: triangles from entry cellCount of
+// CellTriangles, vertices (indexed) from entry latticeCount of LatticeVertices. once they are on the CPU, they size
+// the next extractions, and hasOutputOverflowed is set if they did not fit into maxTriangles / maxVertices although
+// a storage block (blockTriangles / blockVertices) had room for them
+void readOutputTotals(const ExtractionGrid &grid, GLuint maxTriangles, GLuint maxVertices, GLuint blockTriangles, GLuint blockVertices) {
+	std::vector<ReadbackQueue::Range> ranges = {
+		{ cellTrianglesSSBO, (GLintptr)(grid.cellCount() * sizeof(GLuint)), sizeof(GLuint) },
+	};
+	bool isIndexed = useIndexedMesh;
+	if (isIndexed) {
+		ranges.push_back({ latticeVerticesSSBO, (GLintptr)(grid.latticeCount() * sizeof(GLuint)), sizeof(GLuint) });
+	}
+	size_t cellCount = grid.cellCount();
+	readbackQueue.request(ranges, [=](const std::vector<const unsigned char *> &parts) {
+		outTrianglesCount = *(const GLuint *)parts[0];
+		outVerticesCount = isIndexed ? *(const GLuint *)parts[1] : outTrianglesCount * 3;
+		lastTotalTriangles = outTrianglesCount;
+		lastTotalVertices = outVerticesCount;
+		lastTotalsCellCount = cellCount;
+
+		GLuint totalVertices = isIndexed ? outVerticesCount : 0;
+		hasOutputOverflowed = (outTrianglesCount > maxTriangles && maxTriangles < blockTriangles) ||
+			(totalVertices > maxVertices && maxVertices < blockVertices);
+		isMeshTruncated = outTrianglesCount > blockTriangles || totalVertices > blockVertices;
+		if (isMeshTruncated) {
+			printf("the mesh has more triangles or vertices than one GPU buffer holds, only part of it is drawn\n");
+		}
+	});
+}
+
+// cells of outputShape cubes along the longest side of the volume, and the level of volumePyramid they sample
+ExtractionGrid extractionGrid(const int outputShape, const glm::ivec3 inShape) {
+	glm::ivec3 texShape(inShape.y, inShape.z, inShape.x);
+	glm::vec3 texSpacing(voxelSpacing.y, voxelSpacing.z, voxelSpacing.x);
+	ExtractionGrid grid = ExtractionGrid::make(texShape, texSpacing, outputShape);
+	grid.pyramidLevel = useVolumePyramid ? volumePyramid.levelFor(grid.smallestCubeRatio()) : 0;
+	grid.groupCells = extractionGroupCells;
+	return grid;
+}
 
-	computeShader->setFloat("cubeRatio", cubeRatio);
-	computeShader->setFloat("sizeCompressRatio", 10.0 / outputShape);
+// the uniforms of computeShader (in use) every GPU extraction over grid shares, for the whole volume at once
+void setExtractionUniforms(const ExtractionGrid &grid, const float isoLevel) {
+	computeShader->setVec3("cubeRatio", grid.cubeRatio);
+	computeShader->setFloat("sizeCompressRatio", grid.sizeCompressRatio);
+	computeShader->setVec3("gradientScale", grid.gradientScale);
 	computeShader->setFloat("isoLevel", isoLevel);
 
 	if (hasInitializdMarchingCubes == false) {
 		// edgeTable
-		createSSBO(edgeTableSSBO, 256 * sizeof(int), 6, &edgeTable[0], computeShader, "EdgeTable");
+		createSSBO(edgeTableSSBO, 256 * sizeof(int), 6, &edgeTable[0], computeShader);
 		// triTable
-		createSSBO(triTableSSBO, 256 * 16 * sizeof(int), 7, &triTable[0], computeShader, "triTable");
+		createSSBO(triTableSSBO, 256 * 16 * sizeof(int), 7, &triTable[0], computeShader);
+		hasInitializdMarchingCubes = true;
 	}
-	// outPositions
-	createSSBO(outPositionsSSBO, preservedPosMemorySize, 2, outPositions, computeShader, "OutPositions");
-	// outNormals
-	createSSBO(outNormalsSSBO, preservedNormalMemorySize, 3, outNormals, computeShader, "OutNormals");
-	// outTrianglesCount
-	createSSBO(outTrianglesCountSSBO, sizeof(int), 4, &outTrianglesBuffer, computeShader, "OutTrianglesCount");
-	computeShader->setIVec3("inImgShape", inShape.x, inShape.y, inShape.z);
+	glm::ivec3 levelTexShape = volumePyramid.getTexShape(grid.pyramidLevel);
+	glm::ivec3 latticeShape = grid.latticeShape();
+	computeShader->setIVec3("inImgShape", levelTexShape.x, levelTexShape.y, levelTexShape.z);
+	computeShader->setInt("pyramidLevel", grid.pyramidLevel);
+	computeShader->setIVec3("latticeShape", latticeShape.x, latticeShape.y, latticeShape.z);
+	computeShader->setInt("useActiveGroups", useEmptySpaceSkipping || useBrickCache ? 1 : 0);
+	computeShader->setInt("useVolumeSlab", 0);
+	computeShader->setInt("cellLayerOffset", 0);
+}
 
-	glBindImageTexture(1, image3DTexObj, 0, GL_FALSE, 0, GL_READ_ONLY, GL_R16);
+// createMarchingCubes with useSlabBatching: one slab of workgroup layers (along the texture's z) after the other,
+// from the volume on the CPU, into a triangle soup uploaded like the CPU engine's
+void createMarchingCubesInSlabs(const ExtractionGrid &grid, const float isoLevel, const glm::ivec3 inShape, MeshBuffers &mesh) {
+	int pyramidLevel = grid.pyramidLevel;
+	glm::ivec3 groupShape = grid.groupShape();
+	glm::ivec3 cellShape = grid.cellShape;
+	glm::ivec3 levelTexShape = volumePyramid.getTexShape(pyramidLevel);
+	size_t layerVoxels = (size_t)levelTexShape.x * levelTexShape.y;
+	size_t layerBytes = layerVoxels * volumeQuantizer.bytesPerVoxel();
+
+	// as many workgroup layers per slab as slabBatchBytes takes with the halo (see SpanSpaceIndex::groupLevelRange),
+	// but at least one
+	int budgetLayers = (int)std::max(slabBatchBytes / layerBytes, (size_t)1);
+	float groupLayers = grid.groupCells.z * grid.cubeRatio.z / (float)(1 << pyramidLevel);
+	int haloLayers = 2 * normalApron + 4;
+	int slabGroups = std::max((int)((budgetLayers - haloLayers) / groupLayers), 1);
+
+	// layers of the level every slab reads, first and last
+	std::vector<glm::ivec2> slabLayers;
+	slabBatchLayers = 0;
+	for (int firstGroup = 0; firstGroup < groupShape.z; firstGroup += slabGroups) {
+		int lastGroup = std::min(firstGroup + slabGroups, groupShape.z) - 1;
+		int low, high, unused;
+		SpanSpaceIndex::groupLevelRange(firstGroup, grid.groupCells.z, grid.cubeRatio.z, pyramidLevel, levelTexShape.z, normalApron, low, unused);
+		SpanSpaceIndex::groupLevelRange(lastGroup, grid.groupCells.z, grid.cubeRatio.z, pyramidLevel, levelTexShape.z, normalApron, unused, high);
+		slabLayers.push_back(glm::ivec2(low, high));
+		slabBatchLayers = std::max(slabBatchLayers, high - low + 1);
+	}
+	slabBatchCount = (int)slabLayers.size();
+
+	// with empty space skipping, the workgroups of the span space index go to the slab they are in
+	bool useActiveGroups = useEmptySpaceSkipping || useBrickCache;
+	std::vector<std::vector<GLuint>> slabActiveGroups(slabLayers.size());
+	if (useActiveGroups) {
+		std::vector<GLuint> activeGroups;
+		queryActiveGroups(grid, isoLevel, inShape, activeGroups);
+		for (GLuint packed : activeGroups) {
+			slabActiveGroups[(packed >> 20) / slabGroups].push_back(packed);
+		}
+	}
 
-	glDispatchCompute(outputShape / 4, outputShape / 4, outputShape / 4);
-	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+	GLenum internalFormat, type;
+	getVolumeTextureFormat(internalFormat, type);
+	GLuint slabTexObj;
+	glGenTextures(1, &slabTexObj);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_3D, slabTexObj);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexStorage3D(GL_TEXTURE_3D, 1, internalFormat, levelTexShape.x, levelTexShape.y, slabBatchLayers);
 
-	/*
-	for (int batchCount = 0; batchCount < offsets.size(); batchCount += 1) {
-		// inImg
-		computeShader->setIVec3("inImgShape", offsets[batchCount].imgWidth, inShape.y, inShape.z);
-		createSSBO(inImgSSBO, inShape.y*inShape.z*offsets[batchCount].imgWidth * sizeof(float), 1, image3D + (inShape.y * inShape.z) * offsets[batchCount].imgStart, computeShader, "InImg");
+	computeShader->use();
+	setExtractionUniforms(grid, isoLevel);
+	computeShader->setInt("volumeTex", 0);
+	computeShader->setFloat("texelScale", volumeQuantizer.texelScale);
+	computeShader->setFloat("texelOffset", volumeQuantizer.texelOffset);
+	computeShader->setInt("useBrickCache", 0);
+	computeShader->setInt("useVolumeSlab", 1);
+	computeShader->setInt("normalMode", 0);
+
+	GLuint blockVec4s = (GLuint)std::min(getMaxStorageBlockBytes() / (GLint64)sizeof(glm::vec4), (GLint64)UINT32_MAX);
+	isMeshTruncated = false;
+	std::vector<glm::vec4> positions, normals;
+	std::vector<unsigned char> slabVals(layerBytes * slabBatchLayers);
+	const unsigned short *levelVals = volumePyramid.getLevel(pyramidLevel);
+	for (int slab = 0; slab < slabBatchCount; slab++) {
+		int firstGroup = slab * slabGroups;
+		int endGroup = std::min(firstGroup + slabGroups, groupShape.z);
+		// the lattice can have one more workgroup layer than the cells
+		int firstCellLayer = firstGroup * grid.groupCells.z;
+		int endCellLayer = std::min(endGroup * grid.groupCells.z, cellShape.z);
+		if (firstCellLayer >= endCellLayer || (useActiveGroups && slabActiveGroups[slab].empty())) {
+			continue;
+		}
 
-		computeShader->setInt("outputOffset", offsets[batchCount].outputOffset);
-		computeShader->setFloat("imgOffset", offsets[batchCount].imgOffset);
+		// the slab's layers, converted on the thread pool; copied out of slabVals before glTexSubImage3D returns
+		int firstLayer = slabLayers[slab].x;
+		int layers = slabLayers[slab].y - firstLayer + 1;
+		threadPool->parallelFor(0, layers, [&](int layer) {
+			volumeQuantizer.convert(levelVals + layerVoxels * (firstLayer + layer), slabVals.data() + layerBytes * layer, layerVoxels);
+		});
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_3D, slabTexObj);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		glTexSubImage3D(GL_TEXTURE_3D, 0, 0, 0, 0, levelTexShape.x, levelTexShape.y, layers, GL_RED, type, slabVals.data());
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+		if (useActiveGroups) {
+			uploadActiveGroups(slabActiveGroups[slab]);
+		}
+		computeShader->use();
+		computeShader->setIVec3("volumeSlabOrigin", 0, 0, firstLayer);
+		computeShader->setInt("cellLayerOffset", firstCellLayer);
+
+		// exact size output over the cells of the slab
+		glm::ivec3 slabGroupShape(groupShape.x, groupShape.y, endGroup - firstGroup);
+		GLuint slabCells = (GLuint)cellShape.x * cellShape.y * (endCellLayer - firstCellLayer);
+		countCellTriangles(slabCells, slabGroupShape, firstGroup);
+		// the slab is read back right after its passes anyway, so it may as well wait for its total
+		glm::uint slabTriangles = 0;
+		glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, cellTrianglesSSBO);
+		glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, (GLintptr)slabCells * sizeof(GLuint), sizeof(GLuint), &slabTriangles);
+		if (slabTriangles == 0) {
+			continue;
+		}
+		GLuint maxTriangles = std::min(slabTriangles, blockVec4s / 3);
+		isMeshTruncated = isMeshTruncated || maxTriangles < slabTriangles;
+		GLsizeiptr slabOutputBytes = sizeof(glm::vec4) * 3 * (GLsizeiptr)maxTriangles;
+		createSSBO(outPositionsSSBO, slabOutputBytes, 2, nullptr, computeShader);
+		createSSBO(outNormalsSSBO, slabOutputBytes, 3, nullptr, computeShader);
+
+		computeShader->setUInt("maxTriangles", maxTriangles);
+		computeShader->setInt("passMode", 2);
+		dispatchExtraction(slabGroupShape, firstGroup);
+		glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+
+		// appended to the mesh; the next slab sizes its output buffers anew
+		size_t meshVertices = positions.size();
+		positions.resize(meshVertices + 3 * (size_t)maxTriangles);
+		normals.resize(positions.size());
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, outPositionsSSBO);
+		glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, slabOutputBytes, positions.data() + meshVertices);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, outNormalsSSBO);
+		glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, slabOutputBytes, normals.data() + meshVertices);
+	}
+	glDeleteTextures(1, &slabTexObj);
+	bufferPool.release(outPositionsSSBO);
+	bufferPool.release(outNormalsSSBO);
+	outPositionsSSBO = 0;
+	outNormalsSSBO = 0;
+	if (isMeshTruncated) {
+		printf("the mesh has more triangles or vertices than one GPU buffer holds, only part of it is drawn\n");
+	}
+
+	outTrianglesCount = (glm::uint)(positions.size() / 3);
+	outVerticesCount = (glm::uint)positions.size();
+	createMeshBuffers(positions.data(), normals.data(), outVerticesCount, mesh);
+}
+
+// extract into mesh, which must be released. the GPU path only queues its work here:
+// fence it before drawing the mesh from another frame
+void createMarchingCubes(const int outputShape, const float isoLevel, const glm::ivec3 inShape, MeshBuffers &mesh) {
+
+	ExtractionGrid grid = extractionGrid(outputShape, inShape);
+	hasOutputOverflowed = false;
+	if (useCpuEngine) {
+		std::vector<glm::vec4> positions, normals;
+		createMarchingCubesCPU(*threadPool, volumePyramid, grid, maxImgValue, isoLevel, positions, normals);
+		outTrianglesCount = (glm::uint)(positions.size() / 3);
+		outVerticesCount = (glm::uint)positions.size();
+
+		createMeshBuffers(positions.data(), normals.data(), outVerticesCount, mesh);
+		return;
+	}
+	if (useSlabBatching) {
+		createMarchingCubesInSlabs(grid, isoLevel, inShape, mesh);
+		return;
+	}
 
+	int pyramidLevel = grid.pyramidLevel;
+	glm::ivec3 groupShape = grid.groupShape();
 
-		// TODO how large?
-		glDispatchCompute(offsets[batchCount].outputWidth, outputShape / 4, outputShape / 4);
+	if (extractionTimeQuery == 0) {
+		glGenQueries(1, &extractionTimeQuery);
+	}
+	glBeginQuery(GL_TIME_ELAPSED, extractionTimeQuery);
+	isExtractionTimePending = true;
+	extractionGpuMs = -1.0;
+
+	outTrianglesCount = 0;
+
+	// the workgroups cover the lattice, which has one more point per axis than the cells, so one list serves both
+	if (useBrickCache || (useEmptySpaceSkipping && useSpanSpaceIndex)) {
+		std::vector<GLuint> activeGroups;
+		queryActiveGroups(grid, isoLevel, inShape, activeGroups);
+		if (useBrickCache) {
+			makeBricksResident(activeGroups, grid, inShape);
+		}
+		uploadActiveGroups(activeGroups);
+	}
+	else if (useEmptySpaceSkipping) {
+		cullWorkgroups(grid, isoLevel);
+	}
+
+	computeShader->use();
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+	setExtractionUniforms(grid, isoLevel);
+	glm::ivec3 levelTexShape = volumePyramid.getTexShape(pyramidLevel);
+
+	bindVolumeTexture(computeShader);
+	computeShader->setInt("useBrickCache", useBrickCache ? 1 : 0);
+	if (useBrickCache) {
+		glm::ivec3 brickGrid = BrickCache::gridShape(levelTexShape);
+		glm::ivec3 slotsShape = brickCache.getSlotsShape();
+		glActiveTexture(GL_TEXTURE3);
+		glBindTexture(GL_TEXTURE_3D, brickCacheTexObj);
+		glActiveTexture(GL_TEXTURE0);
+		computeShader->setInt("brickCacheTex", 3);
+		computeShader->setIVec3("levelTexShape", levelTexShape.x, levelTexShape.y, levelTexShape.z);
+		computeShader->setIVec3("brickGridShape", brickGrid.x, brickGrid.y, brickGrid.z);
+		computeShader->setIVec3("cacheSlotsShape", slotsShape.x, slotsShape.y, slotsShape.z);
+	}
+
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_3D, gradientTexObj);
+	glActiveTexture(GL_TEXTURE0);
+	computeShader->setInt("gradientTex", 1);
+	computeShader->setInt("normalMode", useGradientTexture && !useBrickCache ? 1 : 0);
+
+	// a buffer of vec4s and one of uints can hold this many, beyond that the mesh is cut short
+	GLuint blockVec4s = (GLuint)std::min(getMaxStorageBlockBytes() / (GLint64)sizeof(glm::vec4), (GLint64)UINT32_MAX);
+	GLuint blockUints = (GLuint)std::min(getMaxStorageBlockBytes() / (GLint64)sizeof(GLuint), (GLint64)UINT32_MAX);
+	GLuint maxTriangles = UINT32_MAX;
+	GLuint maxVertices = UINT32_MAX;
+	isMeshTruncated = false;
+
+	if (useIndexedMesh) {
+		GLuint latticeCount = (GLuint)grid.latticeCount();
+
+		// vertices: count the crossed edges of every lattice point, scan, then write them
+		GLsizeiptr latticeBytes = ((GLsizeiptr)latticeCount + 1) * sizeof(GLuint);
+		createSSBO(latticeVerticesSSBO, latticeBytes, 10, nullptr, computeShader);
+		glClearBufferSubData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, 0, latticeBytes, GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+
+		computeShader->setInt("passMode", 3);
+		dispatchExtraction(groupShape);
 		glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
 
+		scanBuffer(latticeVerticesSSBO, latticeCount + 1);
+		// LatticeVertices keeps vertex offsets in the low 29 bits (latticeOffsetMask in ComputeShader.glsl), and an
+		// offset that does not fit is stored as the mask itself, so the vertices stay below it
+		GLuint latticeVertexLimit = std::min(blockVec4s, (GLuint)((1u << 29) - 1));
+		maxVertices = estimateOutputCapacity(lastTotalVertices, grid.cellCount(), latticeVertexLimit);
+
+		// outPositions
+		createSSBO(outPositionsSSBO, sizeof(glm::vec4) * (GLsizeiptr)maxVertices, 2, outPositions, computeShader);
+		// outNormals
+		createSSBO(outNormalsSSBO, sizeof(glm::vec4) * (GLsizeiptr)maxVertices, 3, outNormals, computeShader);
+
+		computeShader->setUInt("maxVertices", maxVertices);
+		computeShader->setInt("passMode", 4);
+		dispatchExtraction(groupShape);
+		glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+
+		// triangles: 3 indices into the vertices above each
+		countCellTriangles((GLuint)grid.cellCount(), groupShape, 0);
+		maxTriangles = estimateOutputCapacity(lastTotalTriangles, grid.cellCount(), blockUints / 3);
+
+		// outIndices
+		createSSBO(outIndicesSSBO, sizeof(GLuint) * 3 * (GLsizeiptr)maxTriangles, 12, nullptr, computeShader);
+
+		computeShader->setUInt("maxTriangles", maxTriangles);
+		computeShader->setInt("passMode", 5);
+		dispatchExtraction(groupShape);
+		glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+		readOutputTotals(grid, maxTriangles, maxVertices, blockUints / 3, latticeVertexLimit);
+	}
+	else if (useExactSizeOutput) {
+		countCellTriangles((GLuint)grid.cellCount(), groupShape, 0);
+		maxTriangles = estimateOutputCapacity(lastTotalTriangles, grid.cellCount(), blockVec4s / 3);
+
+		// outPositions
+		createSSBO(outPositionsSSBO, sizeof(glm::vec4) * 3 * (GLsizeiptr)maxTriangles, 2, outPositions, computeShader);
+		// outNormals
+		createSSBO(outNormalsSSBO, sizeof(glm::vec4) * 3 * (GLsizeiptr)maxTriangles, 3, outNormals, computeShader);
+
+		computeShader->setUInt("maxTriangles", maxTriangles);
+		computeShader->setInt("passMode", 2);
+		dispatchExtraction(groupShape);
+		glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+		readOutputTotals(grid, maxTriangles, UINT32_MAX, blockVec4s / 3, UINT32_MAX);
+	}
+	else {
+		// the count is only known on the GPU, so the output is sized up front: 2 vertices (2/3 of a triangle) per
+		// cell, at most one storage block of vec4s. a surface cuts few of the cells, into about 2 triangles each, so
+		// that holds it unless the volume is mostly noise; the shader drops the triangles past maxTriangles
+		maxTriangles = (GLuint)std::min(grid.cellCount() * 2, (size_t)blockVec4s) / 3;
+		GLsizeiptr preservedPosMemorySize = sizeof(glm::vec4) * 3 * (GLsizeiptr)maxTriangles;
+		GLsizeiptr preservedNormalMemorySize = sizeof(glm::vec4) * 3 * (GLsizeiptr)maxTriangles;
+
+		// outPositions
+		createSSBO(outPositionsSSBO, preservedPosMemorySize, 2, outPositions, computeShader);
+		// outNormals
+		createSSBO(outNormalsSSBO, preservedNormalMemorySize, 3, outNormals, computeShader);
+		// outTrianglesCount
+		createSSBO(outTrianglesCountSSBO, sizeof(int), 4, &outTrianglesBuffer, computeShader);
+
+		computeShader->setUInt("maxTriangles", maxTriangles);
+		computeShader->setInt("useGroupAllocation", useGroupAllocation ? 1 : 0);
+		computeShader->setInt("passMode", 0);
+		dispatchExtraction(groupShape);
+		glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+
+		// the count stays on the GPU
+		outTrianglesCount = 0;
+		outVerticesCount = 0;
 	}
-	*/
 
-	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, outTrianglesCountSSBO);
-	glBindBuffer(GL_SHADER_STORAGE_BUFFER, outTrianglesCountSSBO);
-	outTrianglesCount = ((glm::uint *)glMapBufferRange(GL_SHADER_STORAGE_BUFFER, 0, sizeof(glm::uint), GL_MAP_READ_BIT))[0];
+	// draw straight from the compute output: the mesh takes over the output SSBOs,
+	// and the next extraction creates new ones
+	glMemoryBarrier(GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT | GL_ELEMENT_ARRAY_BARRIER_BIT);
+	mesh.vertexBuffers[0] = outPositionsSSBO;
+	mesh.vertexBuffers[1] = outNormalsSSBO;
+	outPositionsSSBO = 0;
+	outNormalsSSBO = 0;
+	if (useIndexedMesh) {
+		mesh.vertexBuffers[2] = outIndicesSSBO;
+		outIndicesSSBO = 0;
+	}
+	createMeshVAO(mesh, mesh.vertexBuffers[0], 0, mesh.vertexBuffers[1], 0);
+	mesh.vertexCapacity = useIndexedMesh ? maxVertices : maxTriangles * 3;
+	mesh.indexCapacity = useIndexedMesh ? maxTriangles * 3 : 0;
+	if (useIndexedMesh || useExactSizeOutput) {
+		// the last entry of the scanned counts is the total
+		writeDrawCommand(cellTrianglesSSBO, (GLuint)grid.cellCount(), maxTriangles, mesh);
+	}
+	else {
+		writeDrawCommand(outTrianglesCountSSBO, 0, maxTriangles, mesh);
+	}
+	glEndQuery(GL_TIME_ELAPSED);
+}
 
-	int totalPositionSize = sizeof(glm::vec4) * 3 * outTrianglesCount;
-	int totalNormalSize = sizeof(glm::vec4) * 3 * outTrianglesCount;
+// extract into mesh and wait for the GPU to be done with it, redoing an extraction that outgrew its output buffers;
+// for the callers that have no later frame to finish on
+void createMarchingCubesNow(const int outputShape, const float isoLevel, const glm::ivec3 inShape, MeshBuffers &mesh) {
+	createMarchingCubes(outputShape, isoLevel, inShape, mesh);
+	readbackQueue.finish();
+	if (hasOutputOverflowed) {
+		// sized from the totals just read back, it fits
+		releaseMesh(mesh);
+		createMarchingCubes(outputShape, isoLevel, inShape, mesh);
+		readbackQueue.finish();
+	}
+}
 
-	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, outPositionsSSBO);
-	glBindBuffer(GL_SHADER_STORAGE_BUFFER, outPositionsSSBO);
-	float *positions = (float *)glMapBufferRange(GL_SHADER_STORAGE_BUFFER, 0, totalPositionSize, GL_MAP_READ_BIT);
-	
-	glBindBuffer(GL_SHADER_STORAGE_BUFFER, outNormalsSSBO);
-	float *normals = (float *)glMapBufferRange(GL_SHADER_STORAGE_BUFFER, 0, totalNormalSize, GL_MAP_READ_BIT);
-	
-	// total size of the buffer in bytes
-	glGenVertexArrays(1, &VAO);
-	glGenBuffers(1, &VBO);
-	glBindVertexArray(VAO);
-	glBindBuffer(GL_ARRAY_BUFFER, VBO);
-	glBufferData(GL_ARRAY_BUFFER, totalPositionSize + totalNormalSize, nullptr, GL_STATIC_DRAW);
+// called once per frame: the time of the last GPU extraction into extractionGpuMs, once the GPU has it
+void pollExtractionTime() {
+	if (!isExtractionTimePending) {
+		return;
+	}
+	GLint isAvailable = 0;
+	glGetQueryObjectiv(extractionTimeQuery, GL_QUERY_RESULT_AVAILABLE, &isAvailable);
+	if (isAvailable) {
+		GLuint64 nanoseconds = 0;
+		glGetQueryObjectui64v(extractionTimeQuery, GL_QUERY_RESULT, &nanoseconds);
+		extractionGpuMs = nanoseconds / 1e6;
+		isExtractionTimePending = false;
+	}
+}
 
-	glBufferSubData(GL_ARRAY_BUFFER, 0, totalPositionSize, positions);
-	glBufferSubData(GL_ARRAY_BUFFER, totalPositionSize, totalNormalSize, normals);
+// ComputeShader.glsl with a local size of groupCells, and the brick side of brickCache compiled in
+Shader *compileExtractionShader(glm::ivec3 groupCells) {
+	return new Shader("ComputeShader.glsl", {
+		{ "GROUP_SIZE_X", std::to_string(groupCells.x) },
+		{ "GROUP_SIZE_Y", std::to_string(groupCells.y) },
+		{ "GROUP_SIZE_Z", std::to_string(groupCells.z) },
+		{ "CACHE_BRICK_SIDE", std::to_string((int)BrickCache::brickSide) },
+	});
+}
 
+void deleteShader(Shader *shader) {
+	glDeleteProgram(shader->ID);
+	delete shader;
+}
 
-	// position attribute
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void*)0);
-	glEnableVertexAttribArray(0);
-	// normal attribute
-	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void*)(totalPositionSize));
-	glEnableVertexAttribArray(1);
+// make computeShader the extraction kernel with the local size stored for this GPU and driver. without one, every
+// candidate of WorkgroupTuner extracts outputShape cubes at isoLevel (with the current options, on the GPU), and the
+// fastest is stored for the next runs
+void tuneExtractionShader(const int outputShape, const float isoLevel, const glm::ivec3 inShape) {
+	std::string deviceKey = WorkgroupTuner::deviceKey();
+	glm::ivec3 groupCells;
+	if (WorkgroupTuner::load(workgroupTuningPath, deviceKey, groupCells)) {
+		Shader *shader = compileExtractionShader(groupCells);
+		if (shader->isLinked()) {
+			deleteShader(computeShader);
+			computeShader = shader;
+			extractionGroupCells = groupCells;
+			return;
+		}
+		deleteShader(shader);
+	}
+
+	bool wasCpuEngine = useCpuEngine;
+	bool wasSlabBatching = useSlabBatching;
+	useCpuEngine = false;
+	useSlabBatching = false;
+	Shader *untunedShader = computeShader;
+	glm::ivec3 untunedGroupCells = extractionGroupCells;
+	MeshBuffers tuningMesh;
+	groupCells = WorkgroupTuner::fastest([&](glm::ivec3 candidate) {
+		Shader *shader = compileExtractionShader(candidate);
+		if (!shader->isLinked()) {
+			deleteShader(shader);
+			return -1.0;
+		}
+		computeShader = shader;
+		extractionGroupCells = candidate;
+		// until the GPU is done, the wait the user sees (not every driver times compute work in GL_TIME_ELAPSED).
+		// the first run also grows the buffer pool and builds the span space index; the best of the others counts
+		double bestMs = -1.0;
+		for (int run = 0; run < 3; run++) {
+			glFinish();
+			auto start = std::chrono::steady_clock::now();
+			createMarchingCubesNow(outputShape, isoLevel, inShape, tuningMesh);
+			glFinish();
+			double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+			releaseMesh(tuningMesh);
+			if (run > 0 && (bestMs < 0.0 || ms < bestMs)) {
+				bestMs = ms;
+			}
+		}
+		printf("workgroup of %d x %d x %d cells: %.2f ms\n", candidate.x, candidate.y, candidate.z, bestMs);
+		deleteShader(shader);
+		return bestMs;
+	});
+	deleteMesh(tuningMesh);
+	isExtractionTimePending = false;
+	useCpuEngine = wasCpuEngine;
+	useSlabBatching = wasSlabBatching;
+
+	computeShader = untunedShader;
+	extractionGroupCells = untunedGroupCells;
+	Shader *shader = compileExtractionShader(groupCells);
+	if (shader->isLinked()) {
+		deleteShader(computeShader);
+		computeShader = shader;
+		extractionGroupCells = groupCells;
+		WorkgroupTuner::save(workgroupTuningPath, deviceKey, groupCells);
+	}
+	else {
+		deleteShader(shader);
+	}
+}
 
-	hasInitializdMarchingCubes = true;
+// called once per frame by the render loop instead of extracting in place: starts the latest request when the
+// previous extraction is done and swaps the finished mesh in, without waiting for the extraction to complete.
+// a request that comes in while an extraction runs supersedes it; the CPU engine stops working on it,
+// a GPU extraction is thrown away once it has finished. so is one whose totals outgrew its output buffers,
+// it is extracted again with the room they need
+void updateMarchingCubes(bool hasNewRequest, const int outputShape, const float isoLevel, const glm::ivec3 inShape) {
+	if (hasNewRequest) {
+		hasPendingRequest = true;
+		pendingOutputShape = outputShape;
+		pendingIsoLevel = isoLevel;
+	}
+
+	if (backMeshFence != 0) {
+		if (glClientWaitSync(backMeshFence, GL_SYNC_FLUSH_COMMANDS_BIT, 0) == GL_TIMEOUT_EXPIRED) {
+			return;
+		}
+		glDeleteSync(backMeshFence);
+		backMeshFence = 0;
+		// the totals were copied ahead of the fence, so they are there
+		readbackQueue.poll();
+		if (hasOutputOverflowed && !hasPendingRequest) {
+			hasPendingRequest = true;
+			pendingOutputShape = backOutputShape;
+			pendingIsoLevel = backIsoLevel;
+		}
+		if (hasPendingRequest) {
+			releaseMesh(backMesh);
+		}
+		else {
+			releaseMesh(frontMesh);
+			std::swap(frontMesh, backMesh);
+			readMeshTriangles(frontMesh);
+		}
+	}
+
+	ExtractionWorker::Result result;
+	if (extractionWorker->takeResult(result)) {
+		outTrianglesCount = (glm::uint)(result.positions.size() / 3);
+		outVerticesCount = (glm::uint)result.positions.size();
+		createMeshBuffers(result.positions.data(), result.normals.data(), outVerticesCount, backMesh);
+		releaseMesh(frontMesh);
+		std::swap(frontMesh, backMesh);
+		readMeshTriangles(frontMesh);
+	}
+
+	if (!hasPendingRequest) {
+		return;
+	}
+	hasPendingRequest = false;
+	if (useCpuEngine) {
+		extractionWorker->submit(extractionGrid(pendingOutputShape, inShape), pendingIsoLevel);
+	}
+	else {
+		// a CPU extraction still running from before the engine was switched must not replace this one
+		extractionWorker->cancel();
+		createMarchingCubes(pendingOutputShape, pendingIsoLevel, inShape, backMesh);
+		backOutputShape = pendingOutputShape;
+		backIsoLevel = pendingIsoLevel;
+		backMeshFence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	}
 }
 
 
 
-std::string getImage3DConfig(int &x, int &y, int &z) {
+// path, then the x y z shape, then optionally the number of header bytes before the first voxel.
+// the path can also be a directory holding a DICOM series or a bricked volume (.bvol), which bring their own shape.
+// further optional keywords:
+//   range <lowest> <highest>: only read the bricks of a bricked volume that hold raw values in this range
+//   roi <x0> <y0> <z0> <x1> <y1> <z1>: only read the bricks of a bricked volume in this voxel box (x y z as the shape)
+//   save_bricked <path>, save_bricked_uncompressed <path>: store the volume that was read as a bricked volume
+//   spacing <x> <y> <z>: distance between voxels along x y z, instead of 1 or what a DICOM series says
+//   export <path>: where the export mesh button writes a binary STL, instead of mesh.stl
+std::string getImage3DConfig(int &x, int &y, int &z, size_t &headerOffset, BrickedVolume::Selection &selection,
+	std::string &brickedPath, bool &compressBricked, glm::vec3 &spacing, std::string &exportPath) {
 	char data[1000];
 	std::ifstream rfile;
 
@@ -135,6 +1511,35 @@ std::string getImage3DConfig(int &x, int &y, int &z) {
 
 	rfile >> x >> y >> z;
 
+	headerOffset = 0;
+	std::string token;
+	while (rfile >> token) {
+		if (token == "range") {
+			rfile >> selection.lowestValue >> selection.highestValue;
+		}
+		else if (token == "roi") {
+			rfile >> selection.roiLow.x >> selection.roiLow.y >> selection.roiLow.z;
+			rfile >> selection.roiHigh.x >> selection.roiHigh.y >> selection.roiHigh.z;
+		}
+		else if (token == "spacing") {
+			rfile >> spacing.x >> spacing.y >> spacing.z;
+		}
+		else if (token == "export") {
+			rfile >> exportPath;
+		}
+		else if (token == "save_bricked" || token == "save_bricked_uncompressed") {
+			rfile >> brickedPath;
+			compressBricked = token == "save_bricked";
+		}
+		else if (token.find_first_not_of("0123456789") == std::string::npos) {
+			headerOffset = strtoull(token.c_str(), NULL, 10);
+		}
+		else {
+			// a keyword this version does not know, rather than a header offset
+			printf("file_config.txt: ignoring unknown keyword %s\n", token.c_str());
+		}
+	}
+
 	rfile.close();
 
 	return data;
@@ -145,7 +1550,14 @@ std::string getImage3DConfig(int &x, int &y, int &z) {
 int main()
 {
 	// config
-	std::string path = getImage3DConfig(imageX, imageY, imageZ);
+	size_t headerOffset;
+	BrickedVolume::Selection brickSelection;
+	std::string brickedPath;
+	bool compressBricked = true;
+	// 0: not given
+	glm::vec3 configSpacing(0.0f);
+	std::string path = getImage3DConfig(imageX, imageY, imageZ, headerOffset, brickSelection, brickedPath, compressBricked, configSpacing,
+		meshExportPath);
 
 	// glfw: initialize and configure
 	// ------------------------------
@@ -212,52 +1624,120 @@ int main()
 	drawWireframeShader = new Shader("WireVertexShader.glsl", "WireFragmentShader.glsl");
 
 	// compute shader
-	computeShader = new Shader("ComputeShader.glsl");
+	computeShader = compileExtractionShader(extractionGroupCells);
+	scanShader = new Shader("ScanShader.glsl");
+	gradientShader = new Shader("GradientShader.glsl");
+	brickShader = new Shader("BrickShader.glsl");
+	drawCommandShader = new Shader("DrawCommandShader.glsl");
+
+	threadPool = new ThreadPool();
 
 	// read medical data
-	glm::ivec3 imgShape(imageX, imageY, imageZ);
-	FILE *fpsrc = NULL;
-	unsigned short *imgValsUINT;
-	imgValsUINT = (unsigned short *)malloc(sizeof(unsigned short) * imageX * imageY * imageZ);
-	errno_t err = fopen_s(&fpsrc, path.c_str(), "r");
-	if (err != 0)
+	std::vector<std::string> seriesFiles;
+	if (listDirectory(path, seriesFiles))
+	{
+		if (!dicomSeries.load(*threadPool, path))
+		{
+			printf("can not read a DICOM series from the directory");
+			return 0;
+		}
+		imageX = dicomSeries.shape.x;
+		imageY = dicomSeries.shape.y;
+		imageZ = dicomSeries.shape.z;
+		imgValsUINT = dicomSeries.voxels.data();
+		voxelSpacing = dicomSeries.spacing;
+		printf("DICOM series OK: %d x %d x %d, voxel = (value - %.0f) * %g\n", imageX, imageY, imageZ, dicomSeries.valueOffset, dicomSeries.valueScale);
+	}
+	else if (BrickedVolume::isBrickedPath(path))
 	{
-		printf("can not open the raw image");
-		return 0;
+		if (!brickedVolume.load(*threadPool, path, brickSelection))
+		{
+			printf("can not read the bricked volume");
+			return 0;
+		}
+		imageX = brickedVolume.shape.x;
+		imageY = brickedVolume.shape.y;
+		imageZ = brickedVolume.shape.z;
+		imgValsUINT = brickedVolume.voxels.data();
+		printf("bricked volume OK: %d x %d x %d, %d of %d bricks read (%.1f MB)\n", imageX, imageY, imageZ,
+			brickedVolume.bricksRead, brickedVolume.brickCount, brickedVolume.bytesRead / 1048576.0);
 	}
-	else
+	if (configSpacing.x > 0.0f && configSpacing.y > 0.0f && configSpacing.z > 0.0f)
 	{
-		printf("IMAGE read OK\n");
+		voxelSpacing = configSpacing;
 	}
-	fread(imgValsUINT, sizeof(unsigned short), imageX * imageY * imageZ, fpsrc);
-	fclose(fpsrc);
-
-	unsigned short maxImgValue = 0;
-
-	for (int i = 0; i < imageX * imageY * imageZ; i++) {
-		if (imgValsUINT[i] > maxImgValue) {
-			maxImgValue = imgValsUINT[i];
+	glm::ivec3 imgShape(imageX, imageY, imageZ);
+	if (dicomSeries.voxels.empty() && brickedVolume.voxels.empty())
+	{
+		if (!rawVolume.open(path, imgShape, headerOffset))
+		{
+			printf("can not open the raw image");
+			return 0;
+		}
+		else
+		{
+			printf(rawVolume.isMapped() ? "IMAGE mapped OK\n" : "IMAGE read OK\n");
+		}
+		imgValsUINT = rawVolume.data();
+	}
+	if (!brickedPath.empty())
+	{
+		if (BrickedVolume::write(*threadPool, brickedPath, imgValsUINT, imgShape, compressBricked))
+		{
+			printf("bricked volume written to %s\n", brickedPath.c_str());
+		}
+		else
+		{
+			printf("can not write the bricked volume to %s\n", brickedPath.c_str());
 		}
 	}
-	computeShader->use();
-	computeShader->setInt("maxImgValue", maxImgValue);
 
+	// volumes too large for one texture are only ever read through the brick cache
+	isVolumeTextureResident = fitsVolumeTexture(imgShape);
+	useBrickCache = !isVolumeTextureResident;
+	if (!isVolumeTextureResident) {
+		printf("the volume does not fit in one texture, bricks of it are paged in as needed\n");
+	}
 
+	// also finds maxImgValue
 	genTexImage3D(imgValsUINT, imgShape);
 
-	free(imgValsUINT);
+	otsuIsoLevel = thresholdToIsoLevel(volumeStatistics.otsuThreshold());
+	for (int threshold : volumeStatistics.peakThresholds(4)) {
+		peakIsoLevels.push_back(thresholdToIsoLevel(threshold));
+	}
+
+	if (isVolumeTextureResident) {
+		genGradientTexture(imgShape);
+		genBrickPyramid(imgShape);
+	}
 
 
 	int outputShape = 30;
 	int oldOutputShape = outputShape;
+	// up to full resolution, as far as the GPU buffers go
+	int inMaxDim = std::max({ imgShape.x, imgShape.y, imgShape.z });
+	int outputShapeLimit = std::min(maxOutputShape(imgShape), std::max(256, inMaxDim));
 
 	float isoLevel = 0.31;
 	float oldIsoLevel = isoLevel;
 
-	unsigned int VAO, VBO;
+	// the R8 window: the suggested iso levels and the current one, with some room around them
+	float windowLowIso = std::min(otsuIsoLevel, isoLevel);
+	float windowHighIso = std::max(otsuIsoLevel, isoLevel);
+	for (float peakIsoLevel : peakIsoLevels) {
+		windowLowIso = std::min(windowLowIso, peakIsoLevel);
+		windowHighIso = std::max(windowHighIso, peakIsoLevel);
+	}
+	windowLowIso = std::max(windowLowIso - 0.1f, 0.0f);
+	windowHighIso = std::min(windowHighIso + 0.1f, 1.0f);
+
+	extractionWorker = new ExtractionWorker(*threadPool, volumePyramid, maxImgValue);
+	// on a grid fine enough for the kernel to dominate
+	tuneExtractionShader(std::min(outputShapeLimit, 128), isoLevel, imgShape);
+	createMarchingCubesNow(outputShape, isoLevel, imgShape, frontMesh);
+	readMeshTriangles(frontMesh);
 
-	createMarchingCubes(outputShape, isoLevel, imgShape, VAO, VBO);
-	
 
 	// uniform buffer for draw & draw wireframe
 	unsigned int drawMatIndex = glGetUniformBlockIndex(drawShader->ID, "Matrices");
@@ -317,19 +1797,119 @@ int main()
 			ImGui::Text("Use AWSD to control pitch/yaw; drag to pan camera");
 			ImGui::Text("Application average %.3f ms/frame (%.1f FPS)", 1000.0f / ImGui::GetIO().Framerate, ImGui::GetIO().Framerate);
 			ImGui::SliderFloat("iso level", &isoLevel, 0.0f, 1.0f);            // Edit 1 float using a slider from 0.0f to 1.0f
-			ImGui::SliderInt("num of cubes", &outputShape, 16, 256);            // Edit 1 float using a slider from 0.0f to 1.0f
+			ImGui::SliderInt("num of cubes", &outputShape, 16, outputShapeLimit);            // Edit 1 float using a slider from 0.0f to 1.0f
+			// along the longest side; the others get as many cells as their extent needs
+			glm::ivec3 cellShape = extractionGrid(outputShape, imgShape).cellShape;
+			ImGui::Text("grid %d x %d x %d cells", cellShape.x, cellShape.y, cellShape.z);
+			if (isMeshTruncated) {
+				ImGui::Text("the mesh does not fit in one GPU buffer, only part of it is drawn");
+			}
+			if (frontMeshTriangles >= 0) {
+				ImGui::Text("%lld triangles drawn", frontMeshTriangles);
+			}
+			if (extractionGpuMs >= 0.0) {
+				ImGui::Text("last GPU extraction %.2f ms", extractionGpuMs);
+			}
+			// tuned on the first run on this GPU (see workgroupTuningPath)
+			ImGui::Text("workgroups of %d x %d x %d cells", extractionGroupCells.x, extractionGroupCells.y, extractionGroupCells.z);
+			// kept for the next extractions, which only allocate if they need more
+			ImGui::Text("%.1f MB of GPU buffers", bufferPool.allocatedBytes() / 1048576.0);
+			// the mesh as drawn; the file is written once its buffers have come back, the frames go on meanwhile
+			if (ImGui::Button("export mesh")) {
+				exportMesh(frontMesh);
+			}
+			if (!meshExportStatus.empty()) {
+				ImGui::SameLine();
+				ImGui::Text("%s", meshExportStatus.c_str());
+			}
+			// iso levels from the histogram: Otsu, then the valleys between its peaks
+			ImGui::Text("suggested iso levels:");
+			char isoLabel[32];
+			snprintf(isoLabel, sizeof(isoLabel), "otsu %.3f", otsuIsoLevel);
+			ImGui::SameLine();
+			if (ImGui::Button(isoLabel)) {
+				isoLevel = otsuIsoLevel;
+			}
+			for (size_t i = 0; i < peakIsoLevels.size(); i++) {
+				snprintf(isoLabel, sizeof(isoLabel), "%.3f##peak%zu", peakIsoLevels[i], i);
+				ImGui::SameLine();
+				if (ImGui::Button(isoLabel)) {
+					isoLevel = peakIsoLevels[i];
+				}
+			}
 			ImGui::Checkbox("render wireframe", &doRenderWireframe);
+			if (ImGui::Checkbox("cpu engine", &useCpuEngine)) {
+				// same surface, different backend: extract again
+				oldIsoLevel = -1.0f;
+			}
+			if (ImGui::Checkbox("exact size output", &useExactSizeOutput)) {
+				oldIsoLevel = -1.0f;
+			}
+			if (!useExactSizeOutput && !useIndexedMesh && ImGui::Checkbox("one atomic per workgroup", &useGroupAllocation)) {
+				oldIsoLevel = -1.0f;
+			}
+			if (ImGui::Checkbox("indexed mesh", &useIndexedMesh)) {
+				oldIsoLevel = -1.0f;
+			}
+			if (ImGui::Checkbox("gradient texture normals", &useGradientTexture)) {
+				oldIsoLevel = -1.0f;
+			}
+			if (ImGui::Checkbox("empty space skipping", &useEmptySpaceSkipping)) {
+				oldIsoLevel = -1.0f;
+			}
+			if (ImGui::Checkbox("span space index", &useSpanSpaceIndex)) {
+				oldIsoLevel = -1.0f;
+			}
+			if (ImGui::Checkbox("downsample coarse grids", &useVolumePyramid)) {
+				oldIsoLevel = -1.0f;
+			}
+			// R8 and R16F halve the texture; the CPU engine keeps reading the full precision voxels
+			const char *textureFormats[] = { "R16", "R8 windowed", "R16F" };
+			int textureFormat = volumeQuantizer.format;
+			if (ImGui::Combo("volume texture", &textureFormat, textureFormats, 3)) {
+				setVolumeTextureFormat(textureFormat, windowLowIso, windowHighIso, imgShape);
+				oldIsoLevel = -1.0f;
+			}
+			if (volumeQuantizer.format == VolumeQuantizer::formatR8) {
+				// iso levels kept by the 256 steps; the texture is quantized again once the drag ends
+				ImGui::DragFloatRange2("8 bit window", &windowLowIso, &windowHighIso, 0.001f, 0.0f, 1.0f);
+				if (ImGui::IsItemDeactivatedAfterEdit()) {
+					setVolumeTextureFormat(VolumeQuantizer::formatR8, windowLowIso, windowHighIso, imgShape);
+					oldIsoLevel = -1.0f;
+				}
+			}
+			if (volumeQuantizer.format != VolumeQuantizer::formatR16) {
+				ImGui::Text("error up to %.5f (%.2f raw), %llu voxels clamped, %.1f MB", volumeTextureError,
+					volumeTextureError * maxImgValue * 65535.0f / 65536.0f, (unsigned long long)volumeTextureClampedVoxels,
+					volumeTextureBytes() / 1048576.0);
+			}
+			// gradient texture normals and the culling options do not apply to it
+			if (ImGui::Checkbox("bricked residency", &useBrickCache)) {
+				useBrickCache = useBrickCache || !isVolumeTextureResident;
+				oldIsoLevel = -1.0f;
+			}
+			if (useBrickCache && brickCacheTexObj != 0) {
+				ImGui::Text("%d of %d bricks resident, %d did not fit", brickCache.getResidentCount(), brickCache.getSlotCount(),
+					brickCache.getMissingCount());
+			}
+			// takes the place of the volume texture or the brick cache, also for volumes that are not resident
+			if (ImGui::Checkbox("out of core slabs", &useSlabBatching)) {
+				oldIsoLevel = -1.0f;
+			}
+			if (useSlabBatching && slabBatchCount > 0) {
+				ImGui::Text("%d slabs of up to %d layers", slabBatchCount, slabBatchLayers);
+			}
 			ImGui::End();
 		}
 
 		// Rendering
 		ImGui::Render();
 
-		if (isoLevel != oldIsoLevel || outputShape != oldOutputShape) {
-			createMarchingCubes(outputShape, isoLevel, imgShape, VAO, VBO);
-			oldIsoLevel = isoLevel;
-			oldOutputShape = outputShape;
-		}
+		updateMarchingCubes(isoLevel != oldIsoLevel || outputShape != oldOutputShape, outputShape, isoLevel, imgShape);
+		oldIsoLevel = isoLevel;
+		oldOutputShape = outputShape;
+		readbackQueue.poll();
+		pollExtractionTime();
 
 		float currentFrame = glfwGetTime();
 		deltaTime = currentFrame - lastFrame;
@@ -343,21 +1923,21 @@ int main()
 		glBindBuffer(GL_UNIFORM_BUFFER, uboMatrices);
 		glBufferSubData(GL_UNIFORM_BUFFER, sizeof(glm::mat4), sizeof(glm::mat4), glm::value_ptr(camera->GetViewMat4()));
 		glBufferSubData(GL_UNIFORM_BUFFER, 2 * sizeof(glm::mat4), sizeof(glm::mat4), glm::value_ptr(camera->GetProjectionMat4()));
+		meshToClip = camera->GetProjectionMat4() * camera->GetViewMat4() * modelMat;
+		hasMeshToClip = true;
 		glBindBuffer(GL_UNIFORM_BUFFER, 0);
 
 		glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
 		drawShader->use();
 		drawShader->setVec3("camPos", camera->GetCameraPos());
 		// render boxes
-		glBindVertexArray(VAO);
-		glDrawArrays(GL_TRIANGLES, 0, outTrianglesCount * 3);
+		drawMesh(frontMesh);
 
 		if (doRenderWireframe == true) {
 			glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
 			drawWireframeShader->use();
 			drawWireframeShader->setVec3("camPos", camera->GetCameraPos());
-			glBindVertexArray(VAO);
-			glDrawArrays(GL_TRIANGLES, 0, outTrianglesCount * 3);
+			drawMesh(frontMesh);
 		}
 
 
@@ -378,8 +1958,19 @@ int main()
 	ImGui::DestroyContext();
 
 	// de-allocate all resources
-	glDeleteVertexArrays(1, &VAO);
-	glDeleteBuffers(1, &VBO);
+	readbackQueue.finish();
+	readbackQueue.trim();
+	glDeleteQueries(1, &extractionTimeQuery);
+	delete extractionWorker;
+	if (backMeshFence != 0) {
+		glDeleteSync(backMeshFence);
+	}
+	deleteMesh(frontMesh);
+	deleteMesh(backMesh);
+	bufferPool.trim();
+
+	delete threadPool;
+	rawVolume.close();
 
 	// glfw: terminate, clearing all previously allocated GLFW resources.
 	// ------------------------------------------------------------------
@@ -9,6 +9,21 @@
 #include <GLFW/glfw3.h>
 #include "dcm_reader.h"
 #include "shader_s.h"
+#include "thread_pool.h"
+#include "cpu_marching_cubes.h"
+#include "span_space_index.h"
+#include "extraction_worker.h"
+#include "raw_volume.h"
+#include "volume_statistics.h"
+#include "volume_pyramid.h"
+#include "volume_quantizer.h"
+#include "extraction_grid.h"
+#include "brick_cache.h"
+#include "bricked_volume.h"
+#include "buffer_pool.h"
+#include "readback_queue.h"
+#include "mesh_export.h"
+#include "workgroup_tuner.h"
 #include <hhx_camera_1.0.h>
 
 #include "imgui_impl_glfw.h"
@@ -32,7 +47,10 @@
 const unsigned int SCR_WIDTH = 800;
 const unsigned int SCR_HEIGHT = 600;
 
-Shader *computeShader, *drawShader, *drawWireframeShader;
+Shader *computeShader, *scanShader, *gradientShader, *brickShader, *drawCommandShader, *drawShader, *drawWireframeShader;
+ThreadPool *threadPool;
+// storage of the SSBOs and meshes, kept across extractions
+BufferPool bufferPool;
 
 float deltaTime = 0.0f;
 float lastFrame = 0.0f;
@@ -82,23 +100,23 @@ void framebuffer_size_callback(GLFWwindow* window, int width, int height)
 	camera->ResizeCallback(width, height);
 }
 
-void createSSBO(GLuint &newSSBO, const int memSize, const int bindingIndex, void *buffer, Shader *shader, const char *storageBlockName)
+// bind a buffer with room for memSize bytes (filled from buffer, if given) to bindingIndex of the shader storage blocks
+// and make shader current. newSSBO keeps the buffer it has while that is large enough, otherwise it trades it in at
+// bufferPool for a larger one; the blocks get their bindings in the shaders
+void createSSBO(GLuint &newSSBO, const GLsizeiptr memSize, const int bindingIndex, void *buffer, Shader *shader)
 {
-	glDeleteBuffers(1, &newSSBO);
-	glGenBuffers(1, &newSSBO);
-	int a = glGetError();
+	if (newSSBO == 0 || bufferPool.capacity(newSSBO) < memSize) {
+		bufferPool.release(newSSBO);
+		newSSBO = bufferPool.acquire(memSize);
+	}
 	glBindBuffer(GL_SHADER_STORAGE_BUFFER, newSSBO);
-	glBufferData(GL_SHADER_STORAGE_BUFFER, memSize, buffer, GL_DYNAMIC_DRAW);
-	// glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, newSSBO);
-	// glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	if (buffer != nullptr && memSize > 0) {
+		glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, memSize, buffer);
+	}
 
 	shader->use();
-
-	int block_index = glGetProgramResourceIndex(shader->ID, GL_SHADER_STORAGE_BLOCK, storageBlockName);
-	glShaderStorageBlockBinding(shader->ID, block_index, bindingIndex);
-	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, bindingIndex, newSSBO);
-
-	glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+	// only what was asked for: the buffer can be larger than a storage block may be
+	glBindBufferRange(GL_SHADER_STORAGE_BUFFER, bindingIndex, newSSBO, 0, std::max(memSize, (GLsizeiptr)sizeof(GLuint)));
 }
 
 int edgeTable[256] = {
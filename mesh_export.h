@@ -0,0 +1,66 @@
+#pragma once
+#ifndef MESH_EXPORT
+#define MESH_EXPORT
+
+#include <glm/glm.hpp>
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <cstdint>
+#include <cstring>
+
+// binary STL of triangleCount triangles, given as 3 indices each into positions / normals (vertexCount of them),
+// or as consecutive vertices if indices is nullptr. STL wants one normal per facet: the vertex normals averaged.
+// triangles with an index past the vertices are left out
+inline bool writeBinaryStl(const std::string &path, const glm::vec4 *positions, const glm::vec4 *normals, const uint32_t *indices,
+	size_t triangleCount, size_t vertexCount)
+{
+	std::ofstream file(path, std::ios::binary);
+	if (!file) {
+		return false;
+	}
+	char header[80] = "marching cubes";
+	file.write(header, sizeof(header));
+	// patched once the triangles left out are known
+	uint32_t writtenCount = 0;
+	file.write((const char *)&writtenCount, sizeof(writtenCount));
+
+	// 12 floats and a 2 byte attribute per triangle, written a batch at a time
+	const size_t facetBytes = 50;
+	std::vector<char> batch;
+	for (size_t triangle = 0; triangle < triangleCount; triangle++) {
+		size_t vertices[3];
+		bool isInside = true;
+		for (int i = 0; i < 3; i++) {
+			vertices[i] = indices != nullptr ? indices[triangle * 3 + i] : triangle * 3 + i;
+			isInside = isInside && vertices[i] < vertexCount;
+		}
+		if (!isInside) {
+			continue;
+		}
+		glm::vec3 normal = glm::vec3(normals[vertices[0]]) + glm::vec3(normals[vertices[1]]) + glm::vec3(normals[vertices[2]]);
+		float normalLength = glm::length(normal);
+		normal = normalLength > 0.0f ? normal / normalLength : glm::vec3(0.0f);
+		float facet[12] = { normal.x, normal.y, normal.z };
+		for (int i = 0; i < 3; i++) {
+			facet[3 + i * 3] = positions[vertices[i]].x;
+			facet[4 + i * 3] = positions[vertices[i]].y;
+			facet[5 + i * 3] = positions[vertices[i]].z;
+		}
+		size_t offset = batch.size();
+		batch.resize(offset + facetBytes, 0);
+		memcpy(batch.data() + offset, facet, sizeof(facet));
+		writtenCount++;
+		if (batch.size() >= (1 << 20)) {
+			file.write(batch.data(), batch.size());
+			batch.clear();
+		}
+	}
+	file.write(batch.data(), batch.size());
+	file.seekp(sizeof(header));
+	file.write((const char *)&writtenCount, sizeof(writtenCount));
+	return (bool)file;
+}
+
+#endif
@@ -0,0 +1,184 @@
+#pragma once
+#ifndef RAW_VOLUME
+#define RAW_VOLUME
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include <glm/glm.hpp>
+
+#include <string>
+#include <vector>
+#include <fstream>
+
+// read one byte of every page in [begin, begin + size), so that a mapped file is pulled in from disk
+// on the calling thread instead of page fault by page fault wherever it is read first
+inline void prefetchPages(const void *begin, size_t size)
+{
+	const size_t pageSize = 4096;
+	const volatile char *bytes = (const volatile char *)begin;
+	char sum = 0;
+	for (size_t offset = 0; offset < size; offset += pageSize) {
+		sum += bytes[offset];
+	}
+	if (size > 0) {
+		sum += bytes[size - 1];
+	}
+	(void)sum;
+}
+
+// a raw file of 16 bit voxels, memory mapped read-only: the texture upload and the CPU engine read straight from
+// the page cache, so the voxels never get a heap copy of their own and opening a cached file again costs next to nothing.
+// falls back to reading the file into memory if it cannot be mapped, or if headerOffset leaves the voxels misaligned
+class RawVolume
+{
+public:
+	RawVolume() {}
+	RawVolume(const RawVolume &) = delete;
+	RawVolume &operator=(const RawVolume &) = delete;
+
+	~RawVolume()
+	{
+		close();
+	}
+
+	// shape is in voxels; headerOffset is the number of bytes before the first voxel
+	bool open(const std::string &path, glm::ivec3 shape, size_t headerOffset = 0)
+	{
+		close();
+		size_t dataSize = sizeof(unsigned short) * (size_t)shape.x * shape.y * shape.z;
+
+		if (headerOffset % sizeof(unsigned short) == 0 && map(path, headerOffset + dataSize)) {
+			voxels = (const unsigned short *)((const char *)mapping + headerOffset);
+			return true;
+		}
+
+		std::ifstream file(path, std::ios::in | std::ios::binary);
+		if (!file) {
+			return false;
+		}
+		fallback.resize(dataSize / sizeof(unsigned short));
+		file.seekg(headerOffset);
+		file.read((char *)fallback.data(), dataSize);
+		if ((size_t)file.gcount() != dataSize) {
+			fallback.clear();
+			return false;
+		}
+		voxels = fallback.data();
+		return true;
+	}
+
+	void close()
+	{
+		if (mapping != nullptr) {
+#ifdef _WIN32
+			UnmapViewOfFile(mapping);
+			closeHandles();
+#else
+			munmap(mapping, mappingSize);
+#endif
+		}
+		mapping = nullptr;
+		mappingSize = 0;
+		fallback.clear();
+		fallback.shrink_to_fit();
+		voxels = nullptr;
+	}
+
+	const unsigned short *data() const
+	{
+		return voxels;
+	}
+
+	bool isMapped() const
+	{
+		return mapping != nullptr;
+	}
+
+private:
+	const unsigned short *voxels = nullptr;
+	void *mapping = nullptr;
+	size_t mappingSize = 0;
+	std::vector<unsigned short> fallback;
+#ifdef _WIN32
+	HANDLE fileHandle = INVALID_HANDLE_VALUE;
+	HANDLE mappingHandle = NULL;
+
+	// close whichever handles are open and forget them, so that closing again does nothing
+	void closeHandles()
+	{
+		if (mappingHandle != NULL) {
+			CloseHandle(mappingHandle);
+			mappingHandle = NULL;
+		}
+		if (fileHandle != INVALID_HANDLE_VALUE) {
+			CloseHandle(fileHandle);
+			fileHandle = INVALID_HANDLE_VALUE;
+		}
+	}
+#endif
+
+	// map the whole file, which has to hold at least minSize bytes
+	bool map(const std::string &path, size_t minSize)
+	{
+#ifdef _WIN32
+		fileHandle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+		if (fileHandle == INVALID_HANDLE_VALUE) {
+			return false;
+		}
+		LARGE_INTEGER fileSize;
+		if (!GetFileSizeEx(fileHandle, &fileSize) || (unsigned long long)fileSize.QuadPart < minSize) {
+			closeHandles();
+			return false;
+		}
+		mappingHandle = CreateFileMappingA(fileHandle, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (mappingHandle == NULL) {
+			closeHandles();
+			return false;
+		}
+		mapping = MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0);
+		if (mapping == nullptr) {
+			closeHandles();
+			return false;
+		}
+		mappingSize = (size_t)fileSize.QuadPart;
+		return true;
+#else
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0) {
+			return false;
+		}
+		struct stat fileStat;
+		if (fstat(fd, &fileStat) != 0 || (size_t)fileStat.st_size < minSize || minSize == 0) {
+			::close(fd);
+			return false;
+		}
+		void *base = mmap(nullptr, (size_t)fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		// the mapping keeps the file open by itself
+		::close(fd);
+		if (base == MAP_FAILED) {
+			return false;
+		}
+		mapping = base;
+		mappingSize = (size_t)fileStat.st_size;
+
+		// the volume is read front to back (max value, texture upload): read ahead aggressively.
+		// these are only hints, so failures (e.g. no huge pages for file mappings) are ignored
+		madvise(mapping, mappingSize, MADV_SEQUENTIAL);
+		madvise(mapping, mappingSize, MADV_WILLNEED);
+#ifdef MADV_HUGEPAGE
+		madvise(mapping, mappingSize, MADV_HUGEPAGE);
+#endif
+		return true;
+#endif
+	}
+};
+
+#endif
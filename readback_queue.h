@@ -0,0 +1,179 @@
+#pragma once
+#ifndef READBACK_QUEUE
+#define READBACK_QUEUE
+
+#include "buffer_pool.h"
+
+#include <cstdio>
+#include <deque>
+#include <vector>
+#include <functional>
+#include <utility>
+
+// copies of GPU buffer ranges to the CPU that never stall the render loop: request() queues glCopyBufferSubData into
+// a staging buffer behind the commands issued so far, with a fence after it, and poll() (once per frame) hands the
+// copies whose fence has signalled to their callbacks. staging buffers are mapped persistently and coherently where
+// the context has glBufferStorage, so a finished copy is read in place; they are kept and reused for later requests
+class ReadbackQueue
+{
+public:
+	struct Range
+	{
+		GLuint buffer;
+		GLintptr offset;
+		GLsizeiptr size;
+	};
+	// parts[i] is the copy of the i-th range (16 byte aligned), valid during the call only
+	typedef std::function<void(const std::vector<const unsigned char *> &parts)> Callback;
+
+	// copy ranges as the commands issued so far leave them, and call onComplete with them from a later poll()
+	void request(const std::vector<Range> &ranges, Callback onComplete)
+	{
+		Pending pending;
+		GLsizeiptr size = 0;
+		for (const Range &range : ranges) {
+			pending.offsets.push_back(size);
+			size += (range.size + 15) / 16 * 16;
+		}
+		pending.staging = acquireStaging(size);
+
+		// the copies read what shaders wrote before
+		glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, pending.staging.buffer);
+		for (size_t i = 0; i < ranges.size(); i++) {
+			if (ranges[i].size > 0) {
+				glBindBuffer(GL_COPY_READ_BUFFER, ranges[i].buffer);
+				glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, ranges[i].offset, pending.offsets[i], ranges[i].size);
+			}
+		}
+		pending.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		// so that the fence gets to signal without anyone waiting on it
+		glFlush();
+		pending.onComplete = std::move(onComplete);
+		pendingCopies.push_back(std::move(pending));
+	}
+
+	// run the callbacks of the copies that are done, oldest first, without waiting for the others
+	void poll()
+	{
+		complete(false);
+	}
+
+	// wait for every copy and run its callback
+	void finish()
+	{
+		complete(true);
+	}
+
+	size_t getPendingCount() const
+	{
+		return pendingCopies.size();
+	}
+
+	// delete the staging buffers no copy is using
+	void trim()
+	{
+		for (Staging &staging : freeStaging) {
+			glDeleteBuffers(1, &staging.buffer);
+		}
+		freeStaging.clear();
+	}
+
+private:
+	struct Staging
+	{
+		GLuint buffer = 0;
+		GLsizeiptr capacity = 0;
+		// persistent mapping, or nullptr if the buffer is mapped for each callback
+		unsigned char *mapped = nullptr;
+	};
+	struct Pending
+	{
+		Staging staging;
+		GLsync fence = 0;
+		std::vector<GLsizeiptr> offsets;
+		Callback onComplete;
+	};
+
+	std::vector<Staging> freeStaging;
+	std::deque<Pending> pendingCopies;
+
+	void complete(bool isWaiting)
+	{
+		while (!pendingCopies.empty()) {
+			GLenum status = glClientWaitSync(pendingCopies.front().fence, isWaiting ? GL_SYNC_FLUSH_COMMANDS_BIT : 0,
+				isWaiting ? 1000000000 : 0);
+			if (status == GL_TIMEOUT_EXPIRED) {
+				if (isWaiting) {
+					continue;
+				}
+				return;
+			}
+			if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED) {
+				// GL_WAIT_FAILED says nothing about the copy: wait for all of the GPU's work before reading it
+				printf("waiting for a GPU readback failed (0x%x), finishing the GPU's work instead\n", status);
+				glFinish();
+			}
+			// a callback may queue further copies
+			Pending done = std::move(pendingCopies.front());
+			pendingCopies.pop_front();
+			glDeleteSync(done.fence);
+
+			const unsigned char *data = done.staging.mapped;
+			if (data == nullptr) {
+				// the copy is complete, so this does not wait
+				glBindBuffer(GL_COPY_WRITE_BUFFER, done.staging.buffer);
+				data = (const unsigned char *)glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, done.staging.capacity, GL_MAP_READ_BIT);
+			}
+			std::vector<const unsigned char *> parts;
+			for (GLsizeiptr offset : done.offsets) {
+				parts.push_back(data + offset);
+			}
+			done.onComplete(parts);
+			if (done.staging.mapped == nullptr) {
+				glBindBuffer(GL_COPY_WRITE_BUFFER, done.staging.buffer);
+				glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+			}
+			freeStaging.push_back(done.staging);
+		}
+	}
+
+	// the smallest free staging buffer of at least size bytes; if there is none, the largest free one makes way
+	// for a new one
+	Staging acquireStaging(GLsizeiptr size)
+	{
+		auto best = freeStaging.end();
+		for (auto staging = freeStaging.begin(); staging != freeStaging.end(); ++staging) {
+			if (staging->capacity >= size && (best == freeStaging.end() || staging->capacity < best->capacity)) {
+				best = staging;
+			}
+		}
+		if (best != freeStaging.end()) {
+			Staging staging = *best;
+			freeStaging.erase(best);
+			return staging;
+		}
+		if (!freeStaging.empty()) {
+			auto largest = std::max_element(freeStaging.begin(), freeStaging.end(),
+				[](const Staging &a, const Staging &b) { return a.capacity < b.capacity; });
+			glDeleteBuffers(1, &largest->buffer);
+			freeStaging.erase(largest);
+		}
+
+		Staging staging;
+		staging.capacity = std::max(size, (GLsizeiptr)16);
+		glGenBuffers(1, &staging.buffer);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, staging.buffer);
+		if (contextHasBufferStorage()) {
+			GLbitfield flags = GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+			glBufferStorage(GL_COPY_WRITE_BUFFER, staging.capacity, nullptr, flags);
+			staging.mapped = (unsigned char *)glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, staging.capacity, flags);
+		}
+		else {
+			glBufferData(GL_COPY_WRITE_BUFFER, staging.capacity, nullptr, GL_STREAM_READ);
+		}
+		return staging;
+	}
+};
+
+#endif
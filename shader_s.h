@@ -5,6 +5,7 @@
 #include <glm/glm.hpp>
 
 #include <string>
+#include <map>
 #include <fstream>
 #include <sstream>
 #include <iostream>
@@ -97,7 +98,9 @@ public:
 			glDeleteShader(geometry);
 	}
 
-	Shader(const char* computePath)
+	// a compute shader; every entry of defines becomes "#define name value" right after the #version line,
+	// so the source can specialize on them (a variant per set of defines)
+	Shader(const char* computePath, const std::map<std::string, std::string> &defines = {})
 	{
 		// 1. retrieve the compute source code from filePath
 		std::string computeCode;
@@ -120,6 +123,13 @@ public:
 		{
 			std::cout << "ERROR::SHADER::FILE_NOT_SUCCESFULLY_READ" << std::endl;
 		}
+		std::string defineLines;
+		for (const auto &define : defines)
+		{
+			defineLines += "#define " + define.first + " " + define.second + "\n";
+		}
+		size_t versionEnd = computeCode.find('\n');
+		computeCode.insert(versionEnd == std::string::npos ? computeCode.size() : versionEnd + 1, defineLines);
 		const char* cShaderCode = computeCode.c_str();
 		// 2. compile shaders
 		unsigned int compute;
@@ -138,6 +148,14 @@ public:
 		glDeleteShader(compute);
 	}
 
+	// false if the program did not compile or link, e.g. a variant the GL does not take
+	bool isLinked() const
+	{
+		GLint status = GL_FALSE;
+		glGetProgramiv(ID, GL_LINK_STATUS, &status);
+		return status == GL_TRUE;
+	}
+
 	// activate the shader
 	// ------------------------------------------------------------------------
 	void use()
@@ -156,6 +174,11 @@ public:
 		glUniform1i(glGetUniformLocation(ID, name.c_str()), value);
 	}
 	// ------------------------------------------------------------------------
+	void setUInt(const std::string &name, unsigned int value) const
+	{
+		glUniform1ui(glGetUniformLocation(ID, name.c_str()), value);
+	}
+	// ------------------------------------------------------------------------
 	void setFloat(const std::string &name, float value) const
 	{
 		glUniform1f(glGetUniformLocation(ID, name.c_str()), value);
@@ -0,0 +1,301 @@
+#pragma once
+#ifndef SPAN_SPACE_INDEX
+#define SPAN_SPACE_INDEX
+
+#include "thread_pool.h"
+
+#include <glm/glm.hpp>
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+// span space index over the [min, max] voxel range of every extraction workgroup (see ExtractionGrid::groupCells).
+// built once per grid resolution on the CPU, after which the workgroups that can contain an iso level are found
+// in O(log n + k) through a static interval tree, instead of visiting all n of them on every slider move.
+// no GL calls in here; main.cpp uploads the result as the ActiveGroups list
+class SpanSpaceIndex
+{
+public:
+	// volume is addressed like the R16 texture made by genTexImage3D (see CpuVolumeSampler);
+	// pyramidLevel is the level of the volume pyramid the extraction samples, the ranges are taken at full resolution
+	void build(ThreadPool &pool, const unsigned short *imgVals, glm::ivec3 inShape, int maxImgValue, glm::ivec3 groupShape,
+		glm::ivec3 groupCells, glm::vec3 cubeRatio, int pyramidLevel)
+	{
+		this->groupShape = groupShape;
+		this->groupCells = groupCells;
+		// same normalization as getInputImgData
+		valueScale = 65536.0 / (65535.0 * maxImgValue);
+
+		computeGroupRanges(pool, imgVals, inShape, cubeRatio, pyramidLevel);
+
+		nodes.clear();
+		byMin.clear();
+		byMax.clear();
+		std::vector<int> groups(rangeMin.size());
+		for (int i = 0; i < (int)groups.size(); i++) {
+			groups[i] = i;
+		}
+		byStart = groups;
+		std::sort(byStart.begin(), byStart.end(), [&](int i, int j) { return rangeMin[i] < rangeMin[j]; });
+		root = buildNode(groups);
+	}
+
+	// the packed workgroups (x | y << 10 | z << 20, as BrickShader.glsl writes them) whose range can contain isoLevel
+	void query(float isoLevel, std::vector<unsigned int> &activeGroups) const
+	{
+		activeGroups.clear();
+		if (root < 0) {
+			return;
+		}
+
+		// a cell is cut if one corner is below isoLevel and another is not, so a workgroup is active if
+		// min < iso <= max in raw voxel units. a quarter of a raw unit either way covers float rounding on the GPU.
+		// lowest and highest raw values are integers, so that is min <= a && max >= b with b - a in {0, 1},
+		// i.e. a stab at (a + b) / 2; intervals are stored doubled so that the stab point stays an integer
+		double rawIso = isoLevel / valueScale;
+		int a = (int)std::ceil(rawIso + 0.25) - 1;
+		int b = (int)std::ceil(rawIso - 0.25);
+		query(a, b, activeGroups);
+	}
+
+	// the packed workgroups with min <= highestMin and max >= lowestMax, where lowestMax <= highestMin + 1.
+	// for textures that do not hold the raw values (see VolumeQuantizer::rawBounds) lowestMax can be well below highestMin
+	void query(int highestMin, int lowestMax, std::vector<unsigned int> &activeGroups) const
+	{
+		activeGroups.clear();
+		if (root < 0) {
+			return;
+		}
+		if (lowestMax > highestMin) {
+			stab(highestMin + lowestMax, activeGroups);
+			return;
+		}
+
+		// the groups containing lowestMax, then the ones starting in (lowestMax, highestMin]
+		stab(lowestMax * 2, activeGroups);
+		auto first = std::upper_bound(byStart.begin(), byStart.end(), lowestMax, [&](int value, int group) { return value < rangeMin[group]; });
+		for (auto group = first; group != byStart.end() && rangeMin[*group] <= highestMin; ++group) {
+			activeGroups.push_back(packedGroup(*group));
+		}
+	}
+
+	int getGroupCount() const
+	{
+		return (int)rangeMin.size();
+	}
+
+	// voxels of pyramid level `level` one workgroup of groupCells cells reads along one axis, widened by apron voxels
+	// of the level on either side and clamped to the levelSide voxels there; true if the unclamped range leaves the volume
+	static bool groupLevelRange(int group, int groupCells, float cubeRatio, int level, int levelSide, int apron, int &low, int &high)
+	{
+		float sampleLow = group * groupCells * cubeRatio;
+		float sampleHigh = (group * groupCells + groupCells) * cubeRatio;
+		if (level > 0) {
+			float levelScale = 1.0f / (float)(1 << level);
+			sampleLow = std::max((sampleLow + 0.5f) * levelScale - 0.5f, 0.0f);
+			sampleHigh = std::max((sampleHigh + 0.5f) * levelScale - 0.5f, 0.0f);
+		}
+		low = (int)sampleLow - 1 - apron;
+		high = (int)sampleHigh + 2 + apron;
+		// reading past the volume gives 0
+		bool isOutside = low < 0 || high >= levelSide;
+		low = std::min(std::max(low, 0), levelSide - 1);
+		high = std::min(std::max(high, 0), levelSide - 1);
+		return isOutside;
+	}
+
+private:
+	struct Node
+	{
+		// doubled, like the stab point
+		int center;
+		// intervals containing center, as a range of byMin / byMax
+		int first, count;
+		int left, right;
+	};
+
+	// append the groups whose doubled interval contains point
+	void stab(int point, std::vector<unsigned int> &activeGroups) const
+	{
+		int nodeIndex = root;
+		while (nodeIndex >= 0) {
+			const Node &node = nodes[nodeIndex];
+			if (point < node.center) {
+				// every interval here ends at or after center, so only the start matters
+				for (int i = node.first; i < node.first + node.count && rangeMin[byMin[i]] * 2 <= point; i++) {
+					activeGroups.push_back(packedGroup(byMin[i]));
+				}
+				nodeIndex = node.left;
+			}
+			else if (point > node.center) {
+				for (int i = node.first; i < node.first + node.count && rangeMax[byMax[i]] * 2 >= point; i++) {
+					activeGroups.push_back(packedGroup(byMax[i]));
+				}
+				nodeIndex = node.right;
+			}
+			else {
+				for (int i = node.first; i < node.first + node.count; i++) {
+					activeGroups.push_back(packedGroup(byMin[i]));
+				}
+				nodeIndex = -1;
+			}
+		}
+	}
+
+	// voxels read by one workgroup along one axis; the same conservative box as cullGroup in BrickShader.glsl
+	void groupVoxelRange(int group, int groupCells, float cubeRatio, int level, int texSide, int &low, int &high, bool &isOutside) const
+	{
+		int levelSide = std::max(texSide >> level, 1);
+		isOutside = groupLevelRange(group, groupCells, cubeRatio, level, levelSide, 0, low, high);
+		// a voxel of the level averages 2^level voxels per side
+		low = low << level;
+		high = std::min(((high + 1) << level) - 1, texSide - 1);
+	}
+
+	// min/max over every workgroup's voxel box, one axis at a time: x, then y, then z
+	void computeGroupRanges(ThreadPool &pool, const unsigned short *imgVals, glm::ivec3 inShape, glm::vec3 cubeRatio, int level)
+	{
+		glm::ivec3 g = groupShape;
+		glm::ivec3 texShape(inShape.y, inShape.z, inShape.x);
+		std::vector<int> lows[3], highs[3];
+		std::vector<char> isOutside[3];
+		for (int axis = 0; axis < 3; axis++) {
+			lows[axis].resize(g[axis]);
+			highs[axis].resize(g[axis]);
+			isOutside[axis].assign(g[axis], 0);
+			for (int group = 0; group < g[axis]; group++) {
+				bool outside = false;
+				groupVoxelRange(group, groupCells[axis], cubeRatio[axis], level, texShape[axis], lows[axis][group], highs[axis][group], outside);
+				isOutside[axis][group] = outside;
+			}
+		}
+
+		// (gx, y, z)
+		std::vector<unsigned short> minX((size_t)g.x * texShape.y * texShape.z), maxX(minX.size());
+		pool.parallelFor(0, texShape.z, [&](int z) {
+			for (int y = 0; y < texShape.y; y++) {
+				const unsigned short *row = imgVals + (size_t)texShape.x * (y + (size_t)texShape.y * z);
+				for (int gx = 0; gx < g.x; gx++) {
+					unsigned short minValue = 65535, maxValue = 0;
+					for (int x = lows[0][gx]; x <= highs[0][gx]; x++) {
+						minValue = std::min(minValue, row[x]);
+						maxValue = std::max(maxValue, row[x]);
+					}
+					size_t index = gx + (size_t)g.x * (y + (size_t)texShape.y * z);
+					minX[index] = minValue;
+					maxX[index] = maxValue;
+				}
+			}
+		});
+
+		// (gx, gy, z)
+		std::vector<unsigned short> minXY((size_t)g.x * g.y * texShape.z), maxXY(minXY.size());
+		pool.parallelFor(0, texShape.z, [&](int z) {
+			for (int gy = 0; gy < g.y; gy++) {
+				for (int gx = 0; gx < g.x; gx++) {
+					unsigned short minValue = 65535, maxValue = 0;
+					for (int y = lows[1][gy]; y <= highs[1][gy]; y++) {
+						size_t index = gx + (size_t)g.x * (y + (size_t)texShape.y * z);
+						minValue = std::min(minValue, minX[index]);
+						maxValue = std::max(maxValue, maxX[index]);
+					}
+					size_t index = gx + (size_t)g.x * (gy + (size_t)g.y * z);
+					minXY[index] = minValue;
+					maxXY[index] = maxValue;
+				}
+			}
+		});
+
+		// (gx, gy, gz)
+		rangeMin.resize((size_t)g.x * g.y * g.z);
+		rangeMax.resize(rangeMin.size());
+		pool.parallelFor(0, g.z, [&](int gz) {
+			for (int gy = 0; gy < g.y; gy++) {
+				for (int gx = 0; gx < g.x; gx++) {
+					unsigned short minValue = 65535, maxValue = 0;
+					for (int z = lows[2][gz]; z <= highs[2][gz]; z++) {
+						size_t index = gx + (size_t)g.x * (gy + (size_t)g.y * z);
+						minValue = std::min(minValue, minXY[index]);
+						maxValue = std::max(maxValue, maxXY[index]);
+					}
+					if (isOutside[0][gx] || isOutside[1][gy] || isOutside[2][gz]) {
+						minValue = 0;
+					}
+					size_t index = gx + (size_t)g.x * (gy + (size_t)g.y * gz);
+					rangeMin[index] = minValue;
+					rangeMax[index] = maxValue;
+				}
+			}
+		});
+	}
+
+	// centered interval tree: center is the median endpoint, intervals entirely below or above it go to the children
+	int buildNode(std::vector<int> &groups)
+	{
+		if (groups.empty()) {
+			return -1;
+		}
+
+		std::vector<int> endpoints;
+		endpoints.reserve(groups.size() * 2);
+		for (int group : groups) {
+			endpoints.push_back(rangeMin[group] * 2);
+			endpoints.push_back(rangeMax[group] * 2);
+		}
+		std::nth_element(endpoints.begin(), endpoints.begin() + endpoints.size() / 2, endpoints.end());
+		int center = endpoints[endpoints.size() / 2];
+
+		std::vector<int> below, here, above;
+		for (int group : groups) {
+			if (rangeMax[group] * 2 < center) {
+				below.push_back(group);
+			}
+			else if (rangeMin[group] * 2 > center) {
+				above.push_back(group);
+			}
+			else {
+				here.push_back(group);
+			}
+		}
+		groups.clear();
+		groups.shrink_to_fit();
+
+		Node node;
+		node.center = center;
+		node.first = (int)byMin.size();
+		node.count = (int)here.size();
+		std::sort(here.begin(), here.end(), [&](int i, int j) { return rangeMin[i] < rangeMin[j]; });
+		byMin.insert(byMin.end(), here.begin(), here.end());
+		std::sort(here.begin(), here.end(), [&](int i, int j) { return rangeMax[i] > rangeMax[j]; });
+		byMax.insert(byMax.end(), here.begin(), here.end());
+
+		int nodeIndex = (int)nodes.size();
+		nodes.push_back(node);
+		int left = buildNode(below);
+		int right = buildNode(above);
+		nodes[nodeIndex].left = left;
+		nodes[nodeIndex].right = right;
+		return nodeIndex;
+	}
+
+	unsigned int packedGroup(int group) const
+	{
+		unsigned int x = group % groupShape.x;
+		unsigned int y = group / groupShape.x % groupShape.y;
+		unsigned int z = group / groupShape.x / groupShape.y;
+		return x | (y << 10) | (z << 20);
+	}
+
+	glm::ivec3 groupShape = glm::ivec3(0);
+	glm::ivec3 groupCells = glm::ivec3(4);
+	double valueScale = 1.0;
+	std::vector<unsigned short> rangeMin, rangeMax;
+	std::vector<Node> nodes;
+	std::vector<int> byMin, byMax;
+	// every group, by lowest value
+	std::vector<int> byStart;
+	int root = -1;
+};
+
+#endif
@@ -0,0 +1,117 @@
+#pragma once
+#ifndef THREAD_POOL
+#define THREAD_POOL
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <vector>
+
+// a fixed set of worker threads that run parallel loops
+// the calling thread takes part in every loop, so a pool of size 1 runs serially
+class ThreadPool
+{
+public:
+	ThreadPool(unsigned int numThreads = 0)
+	{
+		if (numThreads == 0) {
+			numThreads = std::thread::hardware_concurrency();
+		}
+		if (numThreads == 0) {
+			numThreads = 1;
+		}
+		for (unsigned int i = 1; i < numThreads; i++) {
+			workers.emplace_back(&ThreadPool::workerLoop, this);
+		}
+	}
+
+	~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(jobMutex);
+			stopping = true;
+		}
+		jobStart.notify_all();
+		for (auto &worker : workers) {
+			worker.join();
+		}
+	}
+
+	unsigned int size() const
+	{
+		return (unsigned int)workers.size() + 1;
+	}
+
+	// run task(i) for every i in [begin, end); indices are handed out one at a time
+	// so uneven work (e.g. slabs full of air next to slabs full of bone) still balances
+	void parallelFor(int begin, int end, const std::function<void(int)> &task)
+	{
+		if (end <= begin) {
+			return;
+		}
+		// one loop at a time; callers on other threads queue up here
+		std::lock_guard<std::mutex> callLock(callMutex);
+		{
+			std::lock_guard<std::mutex> lock(jobMutex);
+			jobTask = &task;
+			jobNext = begin;
+			jobEnd = end;
+			jobPending = (int)workers.size();
+			jobGeneration++;
+		}
+		jobStart.notify_all();
+
+		runJob();
+
+		std::unique_lock<std::mutex> lock(jobMutex);
+		jobDone.wait(lock, [this] { return jobPending == 0; });
+		jobTask = nullptr;
+	}
+
+private:
+	std::vector<std::thread> workers;
+	std::mutex callMutex;
+	std::mutex jobMutex;
+	std::condition_variable jobStart;
+	std::condition_variable jobDone;
+
+	const std::function<void(int)> *jobTask = nullptr;
+	std::atomic<int> jobNext{ 0 };
+	int jobEnd = 0;
+	int jobPending = 0;
+	unsigned long long jobGeneration = 0;
+	bool stopping = false;
+
+	void runJob()
+	{
+		for (int i = jobNext++; i < jobEnd; i = jobNext++) {
+			(*jobTask)(i);
+		}
+	}
+
+	void workerLoop()
+	{
+		unsigned long long seenGeneration = 0;
+		while (true) {
+			{
+				std::unique_lock<std::mutex> lock(jobMutex);
+				jobStart.wait(lock, [&] { return stopping || jobGeneration != seenGeneration; });
+				if (stopping) {
+					return;
+				}
+				seenGeneration = jobGeneration;
+			}
+
+			runJob();
+
+			std::lock_guard<std::mutex> lock(jobMutex);
+			if (--jobPending == 0) {
+				jobDone.notify_one();
+			}
+		}
+	}
+};
+
+#endif
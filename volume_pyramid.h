@@ -0,0 +1,136 @@
+#pragma once
+#ifndef VOLUME_PYRAMID
+#define VOLUME_PYRAMID
+
+#include "thread_pool.h"
+
+#include <glm/glm.hpp>
+
+#include <vector>
+#include <algorithm>
+
+// mip pyramid of the volume for coarse grids: level k averages 2x2x2 voxels of level k - 1, so a cell of
+// cubeRatio voxels can sample the level whose voxels are about its size instead of striding through level 0.
+// level 0 is the volume itself and is not copied; the others are built on the thread pool, level 1 slab by slab
+// while the volume is uploaded (see genTexImage3D), and go into the mip levels of the R16 texture.
+// shapes follow GL mipmaps: halved and rounded down, but at least 1
+class VolumePyramid
+{
+public:
+	// inShape as everywhere else: the texture is inShape.y x inShape.z x inShape.x
+	void begin(const unsigned short *imgVals, glm::ivec3 inShape)
+	{
+		this->inShape = inShape;
+		texShapes.assign(1, glm::ivec3(inShape.y, inShape.z, inShape.x));
+		levels.assign(1, std::vector<unsigned short>());
+		level0 = imgVals;
+
+		// the finest grid the UI offers has 16 cells per side, which never needs voxels larger than inMaxDim / 16
+		int inMaxDim = std::max({ inShape.x, inShape.y, inShape.z });
+		while ((inMaxDim >> (int)texShapes.size()) >= 16) {
+			glm::ivec3 below = texShapes.back();
+			texShapes.push_back(glm::ivec3(std::max(below.x / 2, 1), std::max(below.y / 2, 1), std::max(below.z / 2, 1)));
+			levels.emplace_back((size_t)texShapes.back().x * texShapes.back().y * texShapes.back().z);
+		}
+	}
+
+	// build the layers of level 1 that come from level 0 layers [firstLayer, firstLayer + layerCount);
+	// firstLayer has to be even so that no pair of layers is split between two calls
+	void reduceSlab(ThreadPool &pool, int firstLayer, int layerCount)
+	{
+		if (getLevelCount() < 2) {
+			return;
+		}
+		int firstReduced = firstLayer / 2;
+		int reducedEnd = std::min((firstLayer + layerCount + 1) / 2, texShapes[1].z);
+		// the last layer of an odd volume has no partner and is left out, like glGenerateMipmap does
+		if (firstLayer + layerCount < texShapes[0].z) {
+			reducedEnd = std::min(reducedEnd, (firstLayer + layerCount) / 2);
+		}
+		reduceLayers(pool, 1, firstReduced, reducedEnd);
+	}
+
+	// build the levels above 1, once every layer went through reduceSlab
+	void finish(ThreadPool &pool)
+	{
+		for (int level = 2; level < getLevelCount(); level++) {
+			reduceLayers(pool, level, 0, texShapes[level].z);
+		}
+	}
+
+	int getLevelCount() const
+	{
+		return (int)texShapes.size();
+	}
+
+	// voxels of a level, addressed like the texture
+	const unsigned short *getLevel(int level) const
+	{
+		return level == 0 ? level0 : levels[level].data();
+	}
+
+	// width, height and number of layers of a level's texture
+	glm::ivec3 getTexShape(int level) const
+	{
+		return texShapes[level];
+	}
+
+	// inShape scaled down to a level, as the extraction kernel bounds its reads there
+	glm::ivec3 getInShape(int level) const
+	{
+		return glm::ivec3(std::max(inShape.x >> level, 1), std::max(inShape.y >> level, 1), std::max(inShape.z >> level, 1));
+	}
+
+	// the coarsest level whose voxels are no larger than a cell of cubeRatio voxels
+	int levelFor(float cubeRatio) const
+	{
+		int level = 0;
+		while (level + 1 < getLevelCount() && (float)(1 << (level + 1)) <= cubeRatio) {
+			level++;
+		}
+		return level;
+	}
+
+private:
+	glm::ivec3 inShape;
+	std::vector<glm::ivec3> texShapes;
+	// levels[0] stays empty, level 0 is the caller's volume
+	std::vector<std::vector<unsigned short>> levels;
+	const unsigned short *level0 = nullptr;
+
+	// layers [layerBegin, layerEnd) of level from level - 1, one row per task
+	void reduceLayers(ThreadPool &pool, int level, int layerBegin, int layerEnd)
+	{
+		if (layerEnd <= layerBegin) {
+			return;
+		}
+		glm::ivec3 shape = texShapes[level];
+		glm::ivec3 below = texShapes[level - 1];
+		const unsigned short *src = getLevel(level - 1);
+		unsigned short *dst = levels[level].data();
+		pool.parallelFor(0, (layerEnd - layerBegin) * shape.y, [&](int task) {
+			int z = layerBegin + task / shape.y;
+			int y = task % shape.y;
+			// sides of 1 voxel stay 1 voxel, their only child counts twice
+			int z0 = 2 * z, z1 = std::min(2 * z + 1, below.z - 1);
+			int y0 = 2 * y, y1 = std::min(2 * y + 1, below.y - 1);
+			const unsigned short *rows[4] = {
+				src + (size_t)below.x * (y0 + (size_t)below.y * z0),
+				src + (size_t)below.x * (y1 + (size_t)below.y * z0),
+				src + (size_t)below.x * (y0 + (size_t)below.y * z1),
+				src + (size_t)below.x * (y1 + (size_t)below.y * z1)
+			};
+			unsigned short *dstRow = dst + (size_t)shape.x * (y + (size_t)shape.y * z);
+			for (int x = 0; x < shape.x; x++) {
+				int x0 = 2 * x, x1 = std::min(2 * x + 1, below.x - 1);
+				unsigned int sum = 4;
+				for (const unsigned short *row : rows) {
+					sum += row[x0] + row[x1];
+				}
+				dstRow[x] = (unsigned short)(sum / 8);
+			}
+		});
+	}
+};
+
+#endif
@@ -0,0 +1,215 @@
+#pragma once
+#ifndef VOLUME_QUANTIZER
+#define VOLUME_QUANTIZER
+
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+// F16C comes with every AVX2 CPU; MSVC has no macro for it but does not need one for the intrinsics either
+#if defined(__AVX2__) && (defined(__F16C__) || defined(_MSC_VER))
+#define VOLUME_QUANTIZER_F16C
+#endif
+
+// reduced precision copies of the voxels for the texture modes of setVolumeTextureFormat:
+// R8 quantizes a window of raw values to 256 steps and clamps the rest, R16F stores the iso level units the shaders
+// compare against (raw * 65536 / 65535 / maxImgValue) as half floats. both take half the memory of R16.
+// a texel comes back as texel * texelScale + texelOffset in iso level units, the conversions are vectorized with AVX2
+class VolumeQuantizer
+{
+public:
+	static const int formatR16 = 0;
+	static const int formatR8 = 1;
+	static const int formatR16F = 2;
+
+	int format = formatR16;
+	// raw values in [windowLow, windowHigh] map to 0..255 in R8
+	int windowLow = 0, windowHigh = 65535;
+	// texelFetch result (normalized for R16 and R8) to iso level
+	float texelScale = 1.0f, texelOffset = 0.0f;
+
+	// the window is at least one raw step wide, and a maxImgValue of 0 (an all-zero volume) counts as 1
+	void configure(int format, int maxImgValue, int windowLow, int windowHigh)
+	{
+		maxImgValue = std::max(maxImgValue, 1);
+		this->format = format;
+		this->windowLow = std::min(std::max(windowLow, 0), 65534);
+		this->windowHigh = std::min(std::max(windowHigh, this->windowLow + 1), 65535);
+		isoPerRaw = 65536.0f / 65535.0f / maxImgValue;
+		stepsPerRaw = 255.0f / (this->windowHigh - this->windowLow);
+		if (format == formatR8) {
+			texelScale = (this->windowHigh - this->windowLow) * isoPerRaw;
+			texelOffset = this->windowLow * isoPerRaw;
+		}
+		else if (format == formatR16F) {
+			texelScale = 1.0f;
+			texelOffset = 0.0f;
+		}
+		else {
+			texelScale = 65536.0f / maxImgValue;
+			texelOffset = 0.0f;
+		}
+	}
+
+	size_t bytesPerVoxel() const
+	{
+		return format == formatR8 ? 1 : 2;
+	}
+
+	// count voxels from src into dst, as uint8_t for R8 and half float bits for R16F
+	void convert(const unsigned short *src, void *dst, size_t count) const
+	{
+		size_t i = 0;
+		if (format == formatR8) {
+			uint8_t *steps = (uint8_t *)dst;
+#if defined(__AVX2__)
+			const __m256 low = _mm256_set1_ps((float)windowLow), scale = _mm256_set1_ps(stepsPerRaw);
+			const __m256 zero = _mm256_setzero_ps(), top = _mm256_set1_ps(255.0f);
+			for (; i + 16 <= count; i += 16) {
+				__m256i values = _mm256_loadu_si256((const __m256i *)(src + i));
+				__m256i lowHalf = _mm256_cvtepu16_epi32(_mm256_castsi256_si128(values));
+				__m256i highHalf = _mm256_cvtepu16_epi32(_mm256_extracti128_si256(values, 1));
+				// the same operations as step() below
+				__m256 lowSteps = _mm256_mul_ps(_mm256_sub_ps(_mm256_cvtepi32_ps(lowHalf), low), scale);
+				__m256 highSteps = _mm256_mul_ps(_mm256_sub_ps(_mm256_cvtepi32_ps(highHalf), low), scale);
+				lowSteps = _mm256_min_ps(_mm256_max_ps(_mm256_round_ps(lowSteps, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC), zero), top);
+				highSteps = _mm256_min_ps(_mm256_max_ps(_mm256_round_ps(highSteps, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC), zero), top);
+				// packs work within 128 bit lanes, the permutes put the voxels back in order
+				__m256i words = _mm256_permute4x64_epi64(_mm256_packus_epi32(_mm256_cvttps_epi32(lowSteps), _mm256_cvttps_epi32(highSteps)), 0xD8);
+				__m256i bytes = _mm256_permute4x64_epi64(_mm256_packus_epi16(words, words), 0xD8);
+				_mm_storeu_si128((__m128i *)(steps + i), _mm256_castsi256_si128(bytes));
+			}
+#endif
+			for (; i < count; i++) {
+				steps[i] = step(src[i]);
+			}
+		}
+		else if (format == formatR16F) {
+			unsigned short *halves = (unsigned short *)dst;
+#if defined(VOLUME_QUANTIZER_F16C)
+			const __m256 scale = _mm256_set1_ps(isoPerRaw);
+			for (; i + 8 <= count; i += 8) {
+				__m256i values = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(src + i)));
+				__m128i packed = _mm256_cvtps_ph(_mm256_mul_ps(_mm256_cvtepi32_ps(values), scale), _MM_FROUND_TO_NEAREST_INT);
+				_mm_storeu_si128((__m128i *)(halves + i), packed);
+			}
+#endif
+			for (; i < count; i++) {
+				halves[i] = floatToHalf(src[i] * isoPerRaw);
+			}
+		}
+		else {
+			memcpy(dst, src, count * sizeof(unsigned short));
+		}
+	}
+
+	// the iso level a raw value reads as after the round trip through the texture; never decreases with raw
+	float decode(unsigned short raw) const
+	{
+		if (format == formatR8) {
+			return step(raw) / 255.0f * texelScale + texelOffset;
+		}
+		if (format == formatR16F) {
+			return halfToFloat(floatToHalf(raw * isoPerRaw));
+		}
+		return raw / 65535.0f * texelScale;
+	}
+
+	// error bounds over the raw values that occur in the volume: the largest |decode - exact| in iso level units
+	// (for R8 only inside the window) and the number of voxels R8 clamps to the window
+	void measureError(const std::vector<uint64_t> &histogram, float &maxError, uint64_t &clampedVoxels) const
+	{
+		maxError = 0.0f;
+		clampedVoxels = 0;
+		for (int raw = 0; raw < (int)histogram.size(); raw++) {
+			if (histogram[raw] == 0) {
+				continue;
+			}
+			if (format == formatR8 && (raw < windowLow || raw > windowHigh)) {
+				clampedVoxels += histogram[raw];
+				continue;
+			}
+			maxError = std::max(maxError, std::abs(decode((unsigned short)raw) - raw * isoPerRaw));
+		}
+	}
+
+	// raw bounds for culling at isoLevel: a group can be cut if its min <= highestMin and its max >= lowestMax.
+	// margin (iso level units) covers the rounding of the GPU
+	void rawBounds(float isoLevel, float margin, int &highestMin, int &lowestMax) const
+	{
+		// decode never decreases, so both are binary searches
+		int low = 0, high = 65536;
+		while (low < high) {
+			int middle = (low + high) / 2;
+			if (decode((unsigned short)middle) < isoLevel + margin) low = middle + 1; else high = middle;
+		}
+		highestMin = low - 1;
+		low = 0;
+		high = 65536;
+		while (low < high) {
+			int middle = (low + high) / 2;
+			if (decode((unsigned short)middle) >= isoLevel - margin) high = middle; else low = middle + 1;
+		}
+		lowestMax = low;
+	}
+
+	static unsigned short floatToHalf(float value)
+	{
+		uint32_t bits;
+		memcpy(&bits, &value, sizeof(bits));
+		uint32_t sign = (bits >> 16) & 0x8000;
+		bits &= 0x7FFFFFFF;
+		if (bits >= 0x47800000) {
+			// too large (or NaN): infinity, voxels never get there
+			return (unsigned short)(sign | 0x7C00);
+		}
+		if (bits < 0x38800000) {
+			// subnormal: multiples of 2^-24, rounded to nearest even
+			float magnitude;
+			memcpy(&magnitude, &bits, sizeof(magnitude));
+			return (unsigned short)(sign | (uint32_t)std::nearbyint(magnitude * 16777216.0f));
+		}
+		// rebias the exponent and round the 13 dropped mantissa bits to nearest even
+		uint32_t halfBits = (bits - 0x38000000) >> 13;
+		uint32_t dropped = bits & 0x1FFF;
+		if (dropped > 0x1000 || (dropped == 0x1000 && (halfBits & 1))) {
+			halfBits++;
+		}
+		return (unsigned short)(sign | halfBits);
+	}
+
+	static float halfToFloat(unsigned short half)
+	{
+		float magnitude;
+		int exponent = (half >> 10) & 0x1F;
+		int mantissa = half & 0x3FF;
+		if (exponent == 0) {
+			magnitude = std::ldexp((float)mantissa, -24);
+		}
+		else if (exponent == 31) {
+			magnitude = mantissa == 0 ? INFINITY : NAN;
+		}
+		else {
+			magnitude = std::ldexp((float)(mantissa | 0x400), exponent - 25);
+		}
+		return (half & 0x8000) ? -magnitude : magnitude;
+	}
+
+private:
+	float isoPerRaw = 1.0f;
+	float stepsPerRaw = 1.0f;
+
+	uint8_t step(unsigned short raw) const
+	{
+		// one rounding only (no multiply-add the compiler could fuse), so the vector loop gives the same steps
+		float steps = std::nearbyint(((float)raw - (float)windowLow) * stepsPerRaw);
+		return (uint8_t)std::min(std::max(steps, 0.0f), 255.0f);
+	}
+};
+
+#endif
@@ -0,0 +1,268 @@
+#pragma once
+#ifndef VOLUME_STATISTICS
+#define VOLUME_STATISTICS
+
+#include "thread_pool.h"
+
+#include <glm/glm.hpp>
+
+#include <vector>
+#include <algorithm>
+#include <mutex>
+#include <cstdint>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+// everything the viewer wants to know about the voxel values, gathered in the one pass that uploads the volume
+// (see genTexImage3D): global min/max, a histogram over all 65536 values, min/max of every 8x8x8 brick,
+// and iso levels suggested from the histogram.
+// voxels are visited in the R16 texture order: layer by layer, row by row
+class VolumeStatistics
+{
+public:
+	static const int brickSize = 8;
+
+	unsigned short minValue = 0;
+	unsigned short maxValue = 0;
+	std::vector<uint64_t> histogram;
+	// bricks per side, x fastest; only voxels inside the volume count
+	glm::ivec3 brickShape;
+	std::vector<unsigned short> brickMin, brickMax;
+
+	// texShape is the texture's width, height and number of layers
+	void begin(glm::ivec3 texShape)
+	{
+		this->texShape = texShape;
+		brickShape = (texShape + brickSize - 1) / brickSize;
+		size_t brickCount = (size_t)brickShape.x * brickShape.y * brickShape.z;
+		brickMin.assign(brickCount, 65535);
+		brickMax.assign(brickCount, 0);
+		histogram.assign(65536, 0);
+		partials.clear();
+		freePartials.clear();
+	}
+
+	// accumulate layers [firstLayer, firstLayer + layerCount), with src pointing at the first of them.
+	// if dst is given the layers are copied there on the way (the upload's pixel unpack buffer).
+	// firstLayer has to be a multiple of brickSize so that no brick is split between two calls
+	void accumulateSlab(ThreadPool &pool, const unsigned short *src, unsigned short *dst, int firstLayer, int layerCount)
+	{
+		int brickLayers = (layerCount + brickSize - 1) / brickSize;
+		// one task per band of brickSize rows through brickSize layers: a task owns its bricks
+		pool.parallelFor(0, brickLayers * brickShape.y, [&](int task) {
+			int brickLayer = task / brickShape.y;
+			int band = task % brickShape.y;
+			int layerBegin = brickLayer * brickSize;
+			int layerEnd = std::min(layerBegin + brickSize, layerCount);
+			int rowBegin = band * brickSize;
+			int rowEnd = std::min(rowBegin + brickSize, texShape.y);
+			accumulateBand(src, dst, layerBegin, layerEnd, rowBegin, rowEnd, (firstLayer / brickSize + brickLayer), band);
+		});
+	}
+
+	// merge the partial histograms and take the global min/max from the bricks
+	void finish()
+	{
+		for (auto &partial : partials) {
+			for (int value = 0; value < 65536; value++) {
+				histogram[value] += partial[value];
+			}
+		}
+		partials.clear();
+		partials.shrink_to_fit();
+		freePartials.clear();
+
+		minValue = 65535;
+		maxValue = 0;
+		for (size_t i = 0; i < brickMin.size(); i++) {
+			minValue = std::min(minValue, brickMin[i]);
+			maxValue = std::max(maxValue, brickMax[i]);
+		}
+	}
+
+	// Otsu's threshold: the value t that best splits the voxels into <= t and > t by between-class variance
+	int otsuThreshold() const
+	{
+		double total = 0.0, totalSum = 0.0;
+		for (int value = 0; value < 65536; value++) {
+			total += (double)histogram[value];
+			totalSum += (double)value * histogram[value];
+		}
+
+		// values no voxel has leave the variance unchanged; over such a gap the middle is taken
+		double below = 0.0, belowSum = 0.0, bestVariance = -1.0;
+		int bestFirst = minValue, bestLast = minValue;
+		for (int value = minValue; value < maxValue; value++) {
+			below += (double)histogram[value];
+			belowSum += (double)value * histogram[value];
+			double above = total - below;
+			if (below == 0.0 || above == 0.0) {
+				continue;
+			}
+			double meanDifference = belowSum / below - (totalSum - belowSum) / above;
+			double variance = below * above * meanDifference * meanDifference;
+			if (variance > bestVariance) {
+				bestVariance = variance;
+				bestFirst = value;
+				bestLast = value;
+			}
+			else if (variance == bestVariance) {
+				bestLast = value;
+			}
+		}
+		return (bestFirst + bestLast) / 2;
+	}
+
+	// thresholds halfway between the most prominent peaks of the histogram, i.e. between tissue classes;
+	// at most maxCount of them, in increasing order
+	std::vector<int> peakThresholds(int maxCount) const
+	{
+		// a coarse, smoothed histogram over [minValue, maxValue]
+		const int binCount = 256;
+		double binWidth = std::max(1.0, (maxValue - minValue + 1) / (double)binCount);
+		std::vector<double> bins(binCount, 0.0), smoothed(binCount, 0.0);
+		for (int value = minValue; value <= maxValue; value++) {
+			bins[std::min(binCount - 1, (int)((value - minValue) / binWidth))] += (double)histogram[value];
+		}
+		for (int i = 0; i < binCount; i++) {
+			for (int j = std::max(0, i - 2); j <= std::min(binCount - 1, i + 2); j++) {
+				smoothed[i] += bins[j] / 5.0;
+			}
+		}
+
+		// local maxima holding at least 0.1% of the voxels, the highest ones first
+		double total = 0.0;
+		for (double count : bins) {
+			total += count;
+		}
+		std::vector<int> candidates;
+		for (int i = 0; i < binCount; i++) {
+			bool isPeak = (i == 0 || smoothed[i] > smoothed[i - 1]) && (i == binCount - 1 || smoothed[i] >= smoothed[i + 1]);
+			if (isPeak && smoothed[i] >= total * 0.001) {
+				candidates.push_back(i);
+			}
+		}
+		std::sort(candidates.begin(), candidates.end(), [&](int a, int b) { return smoothed[a] > smoothed[b]; });
+
+		// a peak only counts if the histogram drops below half of the lower peak between it and every peak kept so far;
+		// otherwise it is a bump on the side of a bigger one
+		std::vector<int> peaks;
+		for (int candidate : candidates) {
+			bool isSeparate = true;
+			for (int peak : peaks) {
+				double valley = *std::min_element(smoothed.begin() + std::min(peak, candidate), smoothed.begin() + std::max(peak, candidate) + 1);
+				if (valley >= 0.5 * std::min(smoothed[peak], smoothed[candidate])) {
+					isSeparate = false;
+					break;
+				}
+			}
+			if (isSeparate) {
+				peaks.push_back(candidate);
+			}
+			if ((int)peaks.size() == maxCount + 1) {
+				break;
+			}
+		}
+		std::sort(peaks.begin(), peaks.end());
+
+		std::vector<int> thresholds;
+		for (size_t i = 1; i < peaks.size(); i++) {
+			thresholds.push_back(minValue + (int)((peaks[i - 1] + peaks[i] + 1) * 0.5 * binWidth));
+		}
+		return thresholds;
+	}
+
+private:
+	glm::ivec3 texShape;
+	// one histogram per task that runs at the same time, handed out through freePartials. a task reuses it for every
+	// band it accumulates, so its counts are 64 bit like the total: 32 bit ones wrap past 4G voxels of one value
+	std::vector<std::vector<uint64_t>> partials;
+	std::vector<int> freePartials;
+	std::mutex partialMutex;
+
+	// the histogram stays where it is when partials grows, so the pointer can be used without the lock
+	int acquirePartial(uint64_t *&partialHistogram)
+	{
+		std::lock_guard<std::mutex> lock(partialMutex);
+		int partial;
+		if (freePartials.empty()) {
+			partials.emplace_back(65536, 0);
+			partial = (int)partials.size() - 1;
+		}
+		else {
+			partial = freePartials.back();
+			freePartials.pop_back();
+		}
+		partialHistogram = partials[partial].data();
+		return partial;
+	}
+
+	void releasePartial(int partial)
+	{
+		std::lock_guard<std::mutex> lock(partialMutex);
+		freePartials.push_back(partial);
+	}
+
+	void accumulateBand(const unsigned short *src, unsigned short *dst, int layerBegin, int layerEnd, int rowBegin, int rowEnd, int brickZ, int brickY)
+	{
+		int width = texShape.x;
+		size_t layerVoxels = (size_t)width * texShape.y;
+		uint64_t *partialHistogram;
+		int partial = acquirePartial(partialHistogram);
+
+		// min/max of every voxel column through the band, reduced to bricks at the end
+		std::vector<unsigned short> columnMin(width, 65535), columnMax(width, 0);
+		for (int layer = layerBegin; layer < layerEnd; layer++) {
+			for (int row = rowBegin; row < rowEnd; row++) {
+				size_t rowStart = layerVoxels * layer + (size_t)width * row;
+				const unsigned short *srcRow = src + rowStart;
+				unsigned short *dstRow = dst != nullptr ? dst + rowStart : nullptr;
+
+				int x = 0;
+#if defined(__AVX2__)
+				for (; x + 16 <= width; x += 16) {
+					__m256i values = _mm256_loadu_si256((const __m256i *)(srcRow + x));
+					if (dstRow != nullptr) {
+						_mm256_storeu_si256((__m256i *)(dstRow + x), values);
+					}
+					__m256i *minLanes = (__m256i *)(columnMin.data() + x);
+					__m256i *maxLanes = (__m256i *)(columnMax.data() + x);
+					_mm256_storeu_si256(minLanes, _mm256_min_epu16(_mm256_loadu_si256(minLanes), values));
+					_mm256_storeu_si256(maxLanes, _mm256_max_epu16(_mm256_loadu_si256(maxLanes), values));
+				}
+#endif
+				// the rest of the row, or all of it without AVX2
+				for (; x < width; x++) {
+					unsigned short value = srcRow[x];
+					if (dstRow != nullptr) {
+						dstRow[x] = value;
+					}
+					columnMin[x] = std::min(columnMin[x], value);
+					columnMax[x] = std::max(columnMax[x], value);
+				}
+
+				// scattered increments, the histogram stays scalar
+				for (x = 0; x < width; x++) {
+					partialHistogram[srcRow[x]]++;
+				}
+			}
+		}
+
+		for (int brickX = 0; brickX < brickShape.x; brickX++) {
+			unsigned short minValue = 65535, maxValue = 0;
+			for (int x = brickX * brickSize; x < std::min((brickX + 1) * brickSize, width); x++) {
+				minValue = std::min(minValue, columnMin[x]);
+				maxValue = std::max(maxValue, columnMax[x]);
+			}
+			size_t brick = brickX + (size_t)brickShape.x * (brickY + (size_t)brickShape.y * brickZ);
+			brickMin[brick] = minValue;
+			brickMax[brick] = maxValue;
+		}
+
+		releasePartial(partial);
+	}
+};
+
+#endif
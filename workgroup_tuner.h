@@ -0,0 +1,123 @@
+#pragma once
+#ifndef WORKGROUP_TUNER
+#define WORKGROUP_TUNER
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <functional>
+
+// the local size of the extraction kernel (cells per workgroup and axis) that is fastest on the GPU at hand. the
+// first run on a GPU and driver times every candidate through the caller and stores the fastest in a text file, one
+// "x y z key" line per GPU and driver; later runs read it back. removing the line (or the file) tunes again
+class WorkgroupTuner
+{
+public:
+	// the local sizes the context takes, at least 4 cells along every axis (see ExtractionGrid::maxCellsPerAxis).
+	// longer along x first, the axis along which the texels of a row are next to each other
+	static std::vector<glm::ivec3> candidates()
+	{
+		const glm::ivec3 sizes[] = {
+			glm::ivec3(4, 4, 4), glm::ivec3(8, 4, 4), glm::ivec3(8, 8, 4), glm::ivec3(16, 4, 4), glm::ivec3(16, 8, 4), glm::ivec3(8, 8, 8)
+		};
+		GLint maxInvocations = 0;
+		glGetIntegerv(GL_MAX_COMPUTE_WORK_GROUP_INVOCATIONS, &maxInvocations);
+		GLint maxSize[3] = { 0, 0, 0 };
+		for (int axis = 0; axis < 3; axis++) {
+			glGetIntegeri_v(GL_MAX_COMPUTE_WORK_GROUP_SIZE, axis, &maxSize[axis]);
+		}
+		std::vector<glm::ivec3> usable;
+		for (const glm::ivec3 &size : sizes) {
+			if (size.x * size.y * size.z <= maxInvocations && size.x <= maxSize[0] && size.y <= maxSize[1] && size.z <= maxSize[2]) {
+				usable.push_back(size);
+			}
+		}
+		return usable;
+	}
+
+	// names the GPU and driver of the current context
+	static std::string deviceKey()
+	{
+		std::string key;
+		const GLenum names[] = { GL_VENDOR, GL_RENDERER, GL_VERSION };
+		for (GLenum name : names) {
+			const char *value = (const char *)glGetString(name);
+			key += (key.empty() ? "" : " / ") + std::string(value != nullptr ? value : "");
+		}
+		return key;
+	}
+
+	// the local size stored for deviceKey in the file at path, false if there is none
+	static bool load(const std::string &path, const std::string &deviceKey, glm::ivec3 &groupCells)
+	{
+		std::ifstream file(path);
+		std::string line;
+		while (std::getline(file, line)) {
+			glm::ivec3 size;
+			std::string key;
+			if (parseLine(line, size, key) && key == deviceKey) {
+				groupCells = size;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// store groupCells for deviceKey, keeping the lines of the other GPUs
+	static bool save(const std::string &path, const std::string &deviceKey, glm::ivec3 groupCells)
+	{
+		std::vector<std::string> lines;
+		{
+			std::ifstream file(path);
+			std::string line;
+			while (std::getline(file, line)) {
+				glm::ivec3 size;
+				std::string key;
+				if (parseLine(line, size, key) && key != deviceKey) {
+					lines.push_back(line);
+				}
+			}
+		}
+		std::ostringstream line;
+		line << groupCells.x << " " << groupCells.y << " " << groupCells.z << " " << deviceKey;
+		lines.push_back(line.str());
+
+		std::ofstream file(path, std::ios::trunc);
+		for (const std::string &kept : lines) {
+			file << kept << "\n";
+		}
+		return (bool)file;
+	}
+
+	// the candidate timeMs gives the least time for, in ms; a negative time rules the candidate out
+	static glm::ivec3 fastest(const std::function<double(glm::ivec3)> &timeMs)
+	{
+		glm::ivec3 best = glm::ivec3(4);
+		double bestMs = -1.0;
+		for (const glm::ivec3 &size : candidates()) {
+			double ms = timeMs(size);
+			if (ms >= 0.0 && (bestMs < 0.0 || ms < bestMs)) {
+				best = size;
+				bestMs = ms;
+			}
+		}
+		return best;
+	}
+
+private:
+	static bool parseLine(const std::string &line, glm::ivec3 &size, std::string &key)
+	{
+		std::istringstream stream(line);
+		if (!(stream >> size.x >> size.y >> size.z)) {
+			return false;
+		}
+		std::getline(stream >> std::ws, key);
+		return size.x >= 4 && size.y >= 4 && size.z >= 4;
+	}
+};
+
+#endif